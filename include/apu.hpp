@@ -0,0 +1,133 @@
+#ifndef APU_HPP
+#define APU_HPP
+
+#include "mmu.hpp"
+#include "ringbuffer.hpp"
+#include "scheduler.hpp"
+#include "state.hpp"
+#include "stepbuffer.hpp"
+#include "types.hpp"
+#include "utils.hpp"
+
+// the audio processing unit - two square wave channels (the first with a
+// frequency sweep), a wave channel playing from wave RAM and a noise
+// channel. Nothing is done on every cycle: the channels are only brought up
+// to date when a sound register is accessed or a frame of samples is due,
+// and each change in their output is added to a band limited step buffer
+// rather than generating samples one at a time.
+class APU {
+    public:
+    static const u32 SAMPLE_RATE = 48000;
+
+    // sound register range, including wave RAM
+    static const u16 FIRST_REG = 0xFF10;
+    static const u16 LAST_REG = 0xFF3F;
+
+    APU();
+
+    void bindMMU(MMU *target);
+    void bindScheduler(Scheduler *target);
+
+    // set the registers to their state after the boot ROM
+    void reset();
+
+    // called by the MMU for writes to any sound register
+    void write(u16 addr, u8 data);
+
+    // called by the MMU for reads of any sound register - the APU is run up
+    // to the current time first, so that NR52 shows which channels are
+    // still playing, and the bits that can only be written read as 1s
+    u8 read(u16 addr);
+
+    // run up to now and pass on all the samples finished so far
+    void endFrame();
+
+    // interleaved stereo samples, for the audio thread to play - when
+    // nothing is reading them they are simply dropped
+    RingBuffer<s16> &getOutput();
+
+    void saveState(State::Writer &out);
+    bool loadState(State::Reader &in);
+
+    private:
+    // everything about a channel, some of which only applies to some kinds
+    struct Channel {
+        bool enabled;
+        bool dac;
+
+        // counts down while length is enabled, turning the channel off
+        int length;
+        bool lengthEnabled;
+
+        // volume envelope
+        int volume;
+        int envelopePeriod;
+        int envelopeTimer;
+        bool envelopeUp;
+
+        // cycles per step through the waveform, and when the next is due
+        int period;
+        u64 next;
+        int position;
+
+        // noise channel's linear feedback shift register
+        u16 lfsr;
+
+        // the current output level, 0 - 15
+        int output;
+    };
+
+    struct SavedState {
+        Channel channels[4];
+        bool sweepEnabled;
+        int sweepTimer;
+        int sweepFrequency;
+        int sequencerStep;
+        u64 nextSequencer;
+        u64 time;
+    };
+
+    // the frame sequencer clocks lengths, the sweep and the envelopes
+    static const int SEQUENCER_PERIOD = 8192;
+
+    MMU *mmu;
+    Scheduler *sched;
+
+    Channel channels[4];
+    bool sweepEnabled = false;
+    int sweepTimer = 0;
+    int sweepFrequency = 0;
+    int sequencerStep = 0;
+    u64 nextSequencer = SEQUENCER_PERIOD;
+
+    // everything up to this cycle has been worked out
+    u64 time = 0;
+
+    // last output level on each side, so only changes are added
+    int levels[2] = {0, 0};
+
+    StepBuffer left;
+    StepBuffer right;
+    RingBuffer<s16> output;
+    std::vector<s16> samples;
+
+    // run every channel up to the given cycle, or the current time
+    void catchUp(u64 until);
+    void catchUp();
+
+    void stepSequencer();
+    void stepChannel(int index);
+    void updateOutput(int index);
+    void mix(u64 when);
+
+    void trigger(int index);
+    void updatePeriod(int index);
+    int getFrequency(int index);
+    int getSweepTarget();
+    void stepSweep();
+
+    void powerOff();
+    void updateStatus();
+};
+
+#endif // "apu.hpp" included
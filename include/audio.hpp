@@ -0,0 +1,29 @@
+#ifndef AUDIO_HPP
+#define AUDIO_HPP
+
+#ifndef HEADLESS
+#include "ringbuffer.hpp"
+#include "types.hpp"
+#include <SFML/Audio.hpp>
+#include <vector>
+
+// plays the APU's output through SFML, which pulls samples from the ring
+// buffer on a thread of its own
+class AudioStream : public sf::SoundStream {
+    public:
+    AudioStream(RingBuffer<s16> &source, unsigned sampleRate);
+
+    private:
+    // samples handed over to SFML at a time (per channel) - about 20ms
+    static const size_t CHUNK_SIZE = 1024;
+
+    RingBuffer<s16> &source;
+    std::vector<s16> chunk;
+    s16 last[2] = {0, 0};
+
+    bool onGetData(Chunk &data) override;
+    void onSeek(sf::Time offset) override;
+};
+#endif
+
+#endif // "audio.hpp" included
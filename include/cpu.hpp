@@ -2,60 +2,234 @@
 #define CPU_HPP
 
 #include "mmu.hpp"
+#include "profiler.hpp"
+#include "registers.hpp"
+#include "state.hpp"
+#include "trace.hpp"
 #include "types.hpp"
 #include "utils.hpp"
+#include <array>
+#include <climits>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <sstream>
+#include <utility>
+#include <vector>
 
-class CPU {
+// the registers are a base of the CPU, so ops can use them (and their pairs)
+// by name, and the whole file can still be copied out in one go
+class CPU : private Registers {
     public:
     void reset();
     void bindMMU(MMU *target);
 
     // run the next op and return the number of cycles it took
-    int run();
+    int step();
+
+    // run the next block of ops and return the number of cycles it took -
+    // the block is cut short once 'budget' cycles have passed
+    int run(int budget = INT_MAX);
 
     // return a formatted debug string 
     std::string getState();
 
+    // address of the next op to run
+    u16 getPC() { return PC; }
+
+    // how many cycles into the current run() the op being run started -
+    // for things which are worked out from the time when they're read
+    int getRunCycles();
+
+    // whether loops that only poll memory are skipped through (see run()) -
+    // on by default, except in profiling and tracing builds, which should
+    // see every op
+    void setIdleSkip(bool enabled);
+
+    #ifdef PROFILE
+    // count every op run from now on
+    void bindProfiler(Profiler *target);
+    #endif
+
+    #ifdef TRACE
+    // record every op run from now on
+    void bindTrace(Trace *target);
+    #endif
+
+    // save / restore the register file and interrupt state
+    void saveState(State::Writer &out);
+    bool loadState(State::Reader &in);
+
     // interrupt handling logic
     bool IME = true;
     bool halt = false;
     void callIntVector(u16 addr);
 
     private:
-    u8 A, B, C, D, E, H, L;
-    u16 SP, PC;
+    // everything saved in a save state
+    struct SavedState {
+        Registers regs;
+        bool IME, halt;
+    };
+
+    SavedState getRegisters();
+
+    // whether the registers are all as they were in 'state'
+    bool isUnchanged(const SavedState &state);
 
     MMU *mmu;
 
-    bool branched = false;
+    #if defined(PROFILE) || defined(TRACE)
+    bool idleSkip = false;
+    #else
+    bool idleSkip = true;
+    #endif
+
+    // CPU flags - rather than working each one out after every op (when
+    // most are overwritten before anything reads them), ops keep the values
+    // the flags come from, and they are only worked out when read:
+    //   Z is set when flagZsrc is 0 (the result)
+    //   H is set when bit 4 of flagHsrc is (the carry into bit 4, which is
+    //     bit 4 of lhs ^ rhs ^ result)
+    //   C is set when bit 8 of flagCsrc is (the carry out of bit 7, which is
+    //     bit 8 of the result before it's cut down to a byte)
+    u8 flagZsrc;
+    bool flagN;
+    u8 flagHsrc;
+    u16 flagCsrc;
+
+    bool getZ() { return !flagZsrc; }
+    bool getN() { return flagN; }
+    bool getH() { return flagHsrc & 0x10; }
+    bool getC() { return flagCsrc & 0x100; }
+
+    // the flags as they are laid out in F
+    u8 getF() { return getZ() << 7 | getN() << 6 | getH() << 5 | getC() << 4; }
+    void setF(u8 flags);
+
+    // shortcuts to set multiple flags at once, from the values above
+    void setZNHC(u8 fZ, bool fN, u8 fH, u16 fC) {
+        setZNH(fZ, fN, fH);
+        flagCsrc = fC;
+    }
+
+    void setZNH(u8 fZ, bool fN, u8 fH) {
+        flagZsrc = fZ;
+        flagN = fN;
+        flagHsrc = fH;
+    }
+
+    void setNHC(bool fN, u8 fH, u16 fC) {
+        flagN = fN;
+        flagHsrc = fH;
+        flagCsrc = fC;
+    }
+
+    // each opcode is run by its own handler, which receives the immediate
+    // operand (if any) fetched when the op was decoded
+    typedef void (CPU::*Handler)(u16 imm);
+
+    template <int OP> void op(u16 imm);
+    template <int OP> void opCB(u16 imm);
+
+    // the registers an opcode's 3-bit register fields select - B, C, D, E,
+    // H, L, (HL) and A - where (HL) can be read, written or modified in
+    // place like the rest, but has no reference of its own
+    template <int R> u8 &getReg();
+    template <int R> u8 readReg();
+    template <int R> void writeReg(u8 val);
+    template <int R, typename Fn> void modifyReg(Fn fn);
+
+    // the ALU op and CB rotate / shift that an opcode's 3-bit op field selects
+    template <int Y> void alu(u8 val);
+    template <int Y> void shift(u8 &target);
+
+    // a decoded instruction - everything needed to run it without going back
+    // to memory for the opcode or its operands
+    struct Instr {
+        Handler fn;
+        u16 imm;
+        u8 op;
+        u8 length;
+        u8 cycles;
+    };
+
+    // every opcode's handler, length and cycles, built at compile time - an
+    // op is decoded by copying its entry and filling in the immediate
+    static const std::array<Instr, 0x100> opTable;
+    static const std::array<Instr, 0x100> cbTable;
+
+    template <bool PREFIXED, std::size_t... N>
+    static constexpr std::array<Instr, 0x100>
+    makeTable(std::index_sequence<N...>);
+
+    // CB ops that work on (HL) take 16 cycles (12 for BIT), all others 8
+    static constexpr u8 getCBCycles(int cb) {
+        bool atHL = (cb & 0x07) == 0x06;
+        bool isBIT = cb >= 0x40 && cb < 0x80;
+        return atHL ? (isBIT ? 12 : 16) : 8;
+    }
+
+    // a basic block - a run of straight-line ops ending in a branch (or
+    // anything else that can change the flow of control or interrupts)
+    struct Block {
+        std::vector<Instr> ops;
+
+        // whether the block is a loop that only reads memory (see run())
+        bool polling = false;
+    };
+
+    static const int MAX_BLOCK_OPS = 64;
+    static bool endsBlock(u8 op);
+    static bool readsOnly(const Instr &in);
+    static bool isPollingLoop(const Block &block, u16 start);
+
+    // the blocks compiled from a single bank, indexed by PC & 0x3FFF
+    struct BankCache {
+        std::unique_ptr<Block> blocks[0x4000];
+    };
+
+    Instr decode(u16 addr);
+    const Block *getBlock();
+    BankCache &getBankCache(u16 addr);
+
+    // the block being run, and the address it starts at (see getRunCycles)
+    const Block *running = nullptr;
+    u16 runningStart = 0;
+
+    // ROM can't change, so its code is cached per bank and only allocated
+    // once code is run from that bank
+    std::vector<std::unique_ptr<BankCache>> codeCache;
+
+    #ifdef PROFILE
+    Profiler *profiler = nullptr;
+
+    // pass an op that has just run from 'pc' on to the profiler, following
+    // calls and returns
+    void profile(const Instr &in, u16 bank, u16 pc);
+    u16 getProfileBank(u16 addr);
+    #endif
 
-    // CPU flags and shortcuts to set multiple at once
-    bool flagZ, flagN, flagH, flagC;
-    void setZNHC(bool fZ, bool fN, bool fH, bool fC);
-    void setZNH(bool fZ, bool fN, bool fH);
-    void setNHC(bool fN, bool fH, bool fC);
+    #ifdef TRACE
+    Trace *trace = nullptr;
 
-    // dispatch functions
-    void exec(u8 op);
-    void execCB(u8 op);
+    // record the op about to run, 'offset' cycles into the current run
+    void traceOp(const Instr &in, int offset);
+    #endif
 
     // loads and move instructions
     void LD(u8 &target, u8 val);
     void LDaddrsp(u16 addr);
-    void LDhl(u16 val);
-    void LDrr(u8 &hi, u8 &lo, u16 val);
-    void LDsp(u16 val);
+    void LDhl(s8 val);
+    void LDrr(u16 &target, u16 val);
 
     void LDD(u8 &target, u8 val);
     void LDI(u8 &target, u8 val);
     
-    void PUSH(u8 hi, u8 lo);
+    void PUSH(u16 val);
     void PUSHaf();
 
-    void POP(u8 &hi, u8 &lo);
+    void POP(u16 &target);
     void POPaf();
 
     // logic instructions
@@ -73,14 +247,13 @@ class CPU {
     void ADD(u8 val);
     void ADDhl(u16 val);
     void ADDsp(s8 val);
+    u16 offsetSP(s8 val);
 
     void DEC(u8 &target);
-    void DECrr(u8 &hi, u8 &lo);
-    void DECsp();
+    void DECrr(u16 &target);
 
     void INC(u8 &target);
-    void INCrr(u8 &hi, u8 &lo);
-    void INCsp();
+    void INCrr(u16 &target);
 
     void SBC(u8 val);
     void SUB(u8 val);
@@ -129,10 +302,8 @@ class CPU {
     // tables for fetching PC offsets and cycle count based on the op performed
     // (conditional jumps and calls may add extra cycles if a branch is taken)
     int extraCycles = 0;
-    int getCycleCount(u8 op);
-    int getPCOffset(u8 op);
 
-    int pcOffset[0x100] = {
+    static constexpr u8 pcOffset[0x100] = {
          1,  3,  1,  1,  1,  1,  2,  1,  3,  1,  1,  1,  1,  1,  2,  1,
          2,  3,  1,  1,  1,  1,  2,  1,  2,  1,  1,  1,  1,  1,  2,  1,
          2,  3,  1,  1,  1,  1,  2,  1,  2,  1,  1,  1,  1,  1,  2,  1,
@@ -145,13 +316,13 @@ class CPU {
          1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
          1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
          1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
-         1,  1,  3,  3,  3,  1,  2,  0,  1,  1,  3,  0,  3,  3,  2,  0,
-         1,  1,  3,  1,  3,  1,  2,  0,  1,  1,  3,  1,  3,  1,  2,  0,
-         2,  1,  2,  1,  1,  1,  2,  0,  2,  1,  3,  1,  1,  1,  2,  0,
-         2,  1,  2,  1,  1,  1,  2,  0,  2,  1,  3,  1,  1,  1,  2,  0
+         1,  1,  3,  3,  3,  1,  2,  1,  1,  1,  3,  2,  3,  3,  2,  1,
+         1,  1,  3,  1,  3,  1,  2,  1,  1,  1,  3,  1,  3,  1,  2,  1,
+         2,  1,  1,  1,  1,  1,  2,  1,  2,  1,  3,  1,  1,  1,  2,  1,
+         2,  1,  1,  1,  1,  1,  2,  1,  2,  1,  3,  1,  1,  1,  2,  1
     };
 
-    int cycleCount[0x100] = {
+    static constexpr u8 cycleCount[0x100] = {
          4, 12,  8,  8,  4,  4,  8,  4, 20,  8,  8,  8,  4,  4,  8,  4,
          4, 12,  8,  8,  4,  4,  8,  4, 12,  8,  8,  8,  4,  4,  8,  4,
          8, 12,  8,  8,  4,  4,  8,  4,  8,  8,  8,  8,  4,  4,  8,  4,
@@ -1,33 +1,187 @@
 #ifndef EMULATOR_HPP
 #define EMULATOR_HPP
 
+#include "apu.hpp"
+#include "audio.hpp"
 #include "cpu.hpp"
 #include "mmu.hpp"
+#include "pacer.hpp"
+#include "ppu.hpp"
+#include "rewind.hpp"
+#include "scheduler.hpp"
+#include "timer.hpp"
+
+#ifndef HEADLESS
+#include "triplebuffer.hpp"
+#include <array>
+#include <atomic>
 #include <SFML/System.hpp>
 #include <SFML/Graphics.hpp>
+#endif
 
 class Emulator {
     public:
-    Emulator(char *romPath);
+    Emulator(const char *romPath);
+
+    // whether the ROM could be read - an emulator without one runs, but
+    // only ever sees 0xFF where the cartridge should be
+    bool isLoaded();
+
+    // a frame is 154 lines of 456 cycles each, and the CPU executes 4194304
+    // cycles per second == ~59.7 frames per second
+    static const int CYCLES_PER_FRAME = PPU::LINES * PPU::CYCLES_PER_LINE;
+    static const int CLOCK_SPEED = 4194304;
+
+    #ifndef HEADLESS
+    // open a window and run the emulator in real time (~59.7FPS) - emulation
+    // happens on a thread of its own, handing finished frames over to this
+    // one, which draws them and handles the window's events
     void run();
 
+    // how closely frames kept to time during run()
+    Pacer &getPacer();
+
+    // fast forward runs at 'speed' times real time (0 for as fast as
+    // possible), only passing on as many frames as the screen can show -
+    // Tab toggles it while running
+    void setFastForward(bool enabled, double speed);
+
+    // whether frames that are skipped while fast forwarding are still drawn
+    // (only worth doing to see exactly what the PPU would have done)
+    void setFrameSkip(bool enabled);
+    #endif
+
+    // run as fast as possible without a window until either budget is spent
+    // (a budget of 0 means no limit on that measure)
+    void runHeadless(u64 maxFrames, u64 maxCycles);
+
+    // emulate a single frame's worth of cycles
+    void runFrame();
+
+    // whether loops that only poll memory are skipped through rather than
+    // run op by op (which ends up in exactly the same place, only faster)
+    void setIdleSkip(bool enabled);
+
+    // set which buttons are currently held, as a mask of MMU::JOY_* bits
+    void setButtons(u8 pressed);
+
+    u64 getFrames();
+    u64 getTotalCycles();
+
+    // the screen as of the last frame, as 160x144 RGBA pixels
+    const u32 *getFrame();
+
+    // sound output, as interleaved stereo samples at APU::SAMPLE_RATE
+    RingBuffer<s16> &getAudio();
+
+    // collect every byte sent over the link cable in 'target' (nullptr to
+    // stop), which is how test ROMs report their results
+    void setSerialOutput(std::vector<u8> *target);
+
+    // read a byte of the address space as the CPU would see it
+    u8 peek(u16 addr);
+
+    // FNV-1a hash of all of RAM and the screen, for checking that a run
+    // ended up where it was expected to
+    u64 getHash();
+
+    // snapshot the whole machine into 'out' (which is only ever grown, so
+    // reusing the same buffer avoids any allocation), or restore one - a
+    // state only loads into an emulator running the same ROM
+    void saveState(std::vector<u8> &out);
+    bool loadState(const std::vector<u8> &in);
+
+    // record a snapshot every 'interval' frames, keeping as many as fit in
+    // 'bytes' of memory
+    void enableRewind(size_t bytes, int interval);
+
+    // go back to the most recent snapshot (and forget it, so the next call
+    // goes back further) - false if there are none left
+    bool rewind();
+
+    #ifdef PROFILE
+    // everything the CPU has run so far
+    Profiler &getProfiler();
+    #endif
+
+    #ifdef TRACE
+    // record the last 'entries' ops run (see Trace)
+    void enableTrace(size_t entries);
+    Trace &getTrace();
+    #endif
+
     private:
-    int cycles = 0;
-    int cyclesThisLoop = 0;
+    struct SavedState {
+        u64 frames;
+        u64 frameEnd;
+    };
+
+    // frames completed so far, and the cycle at which the current one ends
+    u64 frames = 0;
+    u64 frameEnd = CYCLES_PER_FRAME;
 
     CPU cpu;
     MMU mmu;
+    Scheduler sched;
+    Timer timer;
+    PPU ppu;
+    APU apu;
+
+    u8 buttons = 0;
+    bool loaded = false;
 
-    sf::Window win;
+    #ifdef PROFILE
+    Profiler profiler;
+    #endif
+
+    #ifdef TRACE
+    Trace trace;
+    #endif
+
+    Rewind history;
+    int rewindInterval = 0;
+    std::vector<u8> rewindState;
+
+    // rewind snapshots store RAM separately, so states can be written
+    // without it
+    void writeState(std::vector<u8> &out, bool withRAM);
+    bool readState(const std::vector<u8> &in, bool withRAM);
+
+    #ifndef HEADLESS
+    typedef std::array<u32, PPU::WIDTH * PPU::HEIGHT> Frame;
+
+    // owned by the window thread
+    sf::RenderWindow win;
+    sf::Texture screen;
+    sf::Sprite sprite;
     sf::Event ev;
-    sf::Clock timer;
+    u8 keys = 0;
+
+    // owned by the emulation thread
+    Pacer pacer;
 
-    int divCounter = 0;
-    int tmaCounter = 0;
+    double fastSpeed = 0;
+    bool frameSkip = true;
 
-    void updateTimers(int cycles);
+    // passed between the two
+    TripleBuffer<Frame> display;
+    std::atomic<bool> fastForward{false};
+    std::atomic<bool> running{false};
+    std::atomic<u8> heldButtons{0};
+    std::atomic<bool> rewindRequested{false};
+    #endif
+
+    // run the CPU until the master cycle counter reaches 'target', handling
+    // events as they fall due
+    void runUntil(u64 target);
+    void handleEvent(Event ev, u64 when);
     void handleInterrupts();
+
+    #ifndef HEADLESS
+    void emulate();
     void handleEvents();
+    void draw();
+    #endif
 };
 
 #endif // "emulator.hpp" included
@@ -1,48 +1,272 @@
 #ifndef MMU_HPP
 #define MMU_HPP
 
+#include "scheduler.hpp"
+#include "state.hpp"
 #include "types.hpp"
+#include "utils.hpp"
 #include <string>
 #include <fstream>
+#include <iostream>
+#include <vector>
+
+class APU;
+class CPU;
+class PPU;
+class Timer;
 
 class MMU {
     public:
     // memory location constants
-    static const u16 
+    static const u16
         JOYP = 0xFF00,
+        SB = 0xFF01,
+        SC = 0xFF02,
         DIV = 0xFF04,
         TIMA = 0xFF05,
         TMA = 0xFF06,
         TAC = 0xFF07,
         IF = 0xFF0F,
+        NR10 = 0xFF10,
+        NR13 = 0xFF13,
+        NR14 = 0xFF14,
+        NR50 = 0xFF24,
+        NR51 = 0xFF25,
+        NR52 = 0xFF26,
+        WAVE = 0xFF30,
+        LCDC = 0xFF40,
+        STAT = 0xFF41,
+        SCY = 0xFF42,
+        SCX = 0xFF43,
+        LY = 0xFF44,
+        LYC = 0xFF45,
         DMA = 0xFF46,
+        BGP = 0xFF47,
+        OBP0 = 0xFF48,
+        OBP1 = 0xFF49,
+        WY = 0xFF4A,
+        WX = 0xFF4B,
         IE = 0xFFFF;
 
-    // attempt to write / read data into memory - this will eventually
-    // contain more logic pertaining to read / write only sections of RAM
-    void write8(u16 addr, u8 data);
-    void write16(u16 addr, u16 data);
+    // joypad buttons, as passed to setJoypad()
+    static const u8
+        JOY_RIGHT = 0x01,
+        JOY_LEFT = 0x02,
+        JOY_UP = 0x04,
+        JOY_DOWN = 0x08,
+        JOY_A = 0x10,
+        JOY_B = 0x20,
+        JOY_SELECT = 0x40,
+        JOY_START = 0x80;
+
+    MMU();
+    ~MMU();
+
+    // the ROM may be mapped from its file, so an MMU can't be copied
+    MMU(const MMU &) = delete;
+    MMU &operator=(const MMU &) = delete;
+
+    // plain ROM and RAM is accessed straight through the page tables - only
+    // unmapped pages (ROM writes, I/O registers, disabled cartridge RAM and
+    // the MBC3 clock) take the slow path
+    void write8(u16 addr, u8 data) {
+        u8 *page = writePage[addr >> 8];
+        if (page) {
+            page[addr & 0xFF] = data;
+            dirty[writeChunk[addr >> 8]] = 1;
+        } else {
+            writeSlow(addr, data);
+        }
+    }
 
-    u8 read8(u16 addr);
+    u8 read8(u16 addr) {
+        const u8 *page = readPage[addr >> 8];
+        if (page) {
+            return page[addr & 0xFF];
+        }
+        return readSlow(addr);
+    }
+
+    void write16(u16 addr, u16 data);
     u16 read16(u16 addr);
 
-    // return a reference to the given address - only allow for writable memory
+    // return a reference to the given address - only allowed for OAM, the
+    // I/O registers and HRAM (0xFE00 - 0xFFFF)
     u8 &getRef(u16 addr);
 
-    // load a ROM into memory - does not support switchable ROM banks yet...
-    void loadROM(std::string path);
+    // direct (read only) access to VRAM and OAM for the PPU
+    const u8 *getVRAM();
+    const u8 *getOAM();
+
+    // load a ROM and set up its memory bank controller from the header - the
+    // file is memory mapped, so banks are only read in once they are used,
+    // and are shared with every other process running the same ROM -
+    // returns false (leaving no ROM loaded) if the file can't be read
+    bool loadROM(std::string path);
+
+    // load a ROM image from memory, which is copied in
+    void loadROM(const u8 *data, size_t size);
+    void unloadROM();
 
-    void updateSpecialRegs();
+    // return the ROM bank currently mapped at the given address
+    u16 getROMBank(u16 addr);
+
+    // the global checksum from the cartridge header, used to check that a
+    // save state belongs to the loaded ROM
+    u16 getROMChecksum();
+
+    // save / restore the MBC state and (optionally) all RAM - the ROM itself
+    // is never saved
+    void saveState(State::Writer &out, bool withRAM);
+    bool loadState(State::Reader &in, bool withRAM);
+
+    // RAM is tracked in 256 byte chunks, which are marked dirty whenever they
+    // are written to (for rewinding, which only stores what has changed)
+    static const u32 CHUNK_SIZE = 0x100;
+    u32 getChunkCount();
+    u8 *getChunk(u32 chunk);
+    const u8 *getDirtyChunks();
+    void markChunkDirty(u32 chunk);
+    void clearDirtyChunks();
+
+    // incremented whenever a different ROM bank is mapped in, so code
+    // running from ROM can tell if it has switched itself out
+    u32 romMapVersion = 0;
+
+    // incremented whenever DIV, TIMA or a sound register is read - unlike
+    // everything else, they change without any event happening (NR52 shows
+    // channels switching off as their lengths run out), so code that polls
+    // them can't be skipped through
+    u32 liveReads = 0;
+
+    // writes to some registers start things happening in other components,
+    // which are scheduled or passed on through these
+    void bindScheduler(Scheduler *target);
+    void bindCPU(CPU *target);
+    void bindTimer(Timer *target);
+    void bindPPU(PPU *target);
+    void bindAPU(APU *target);
+
+    // the cycle the CPU is on, which may be partway through one of its runs
+    // (while the scheduler is still at the start of it) - anything a
+    // register access sets off happens relative to this
+    u64 getTime();
+
+    // set which buttons are held, requesting the JOYPAD interrupt if any
+    // newly pressed ones are visible through JOYP
+    void setJoypad(u8 pressed);
 
     // perform a DMA transfer - RAM -> OAM
     void doDMATransfer();
 
+    // finish shifting out the byte in SB - there is never anything on the
+    // other end of the link cable, so 0xFF is shifted in
+    void finishSerialTransfer();
+
+    // append every byte shifted out to 'target', which is how test ROMs
+    // report their results (or stop, given nullptr)
+    void bindSerialOutput(std::vector<u8> *target);
+
     private:
-    u8 memory[0xFFFF] = {0};
+    // everything saved in a save state besides the contents of RAM
+    struct SavedState {
+        u32 ramSize;
+        bool ramEnabled;
+        u16 romBank;
+        u8 ramBank;
+        u8 mbc1Upper;
+        bool mbc1Mode;
+        u64 rtcTime;
+        u64 rtcSync;
+        bool rtcHalted;
+        bool rtcCarry;
+        u8 rtcLatch;
+        u8 rtcLatched[5];
+    };
+
+    // all RAM lives in one buffer, laid out as below, with cartridge RAM
+    // (of whatever size the cartridge has) on the end
+    static const u32
+        VRAM_OFFSET = 0x0000,
+        WRAM_OFFSET = 0x2000,
+        HIGH_OFFSET = 0x4000,   // OAM, I/O registers, HRAM and IE
+        ERAM_OFFSET = 0x4200;
+
+    const u8 *rom = nullptr;
+    size_t romSize = 0;
+    bool romMapped = false;
+
+    // ROMs that can't be mapped straight from their file (e.g. ones that
+    // aren't a whole number of banks) are copied in and padded instead
+    std::vector<u8> romCopy;
+
+    std::vector<u8> ram;
+
+    // one entry per 256 byte page - null entries take the slow path (tile
+    // data is only readable through the page table, so writes to it can
+    // invalidate the PPU's decoded tiles)
+    const u8 *readPage[0x100] = {nullptr};
+    u8 *writePage[0x100] = {nullptr};
+
+    // the RAM chunk each writable page maps to, and a dirty flag per chunk
+    u32 writeChunk[0x100] = {0};
+    std::vector<u8> dirty;
+
+    void writeSlow(u16 addr, u8 data);
+    u8 readSlow(u16 addr);
+    u8 readIO(u16 addr);
+    void writeIO(u16 addr, u8 data);
+
+    void mapPages(int first, int count, const u8 *readBase, u8 *writeBase);
+    void mapMemory();
+
+    Scheduler *sched = nullptr;
+    CPU *cpu = nullptr;
+    Timer *timer = nullptr;
+    PPU *ppu = nullptr;
+    APU *apu = nullptr;
+    std::vector<u8> *serialOutput = nullptr;
+
+    // buttons currently held - JOYP is kept up to date with these, rather
+    // than being worked out on every read
+    u8 joypad = 0;
+    void updateJOYP();
+
+    // memory bank controller state - see mbc.cpp
+    enum MBCType { MBC_NONE, MBC_1, MBC_3, MBC_5 };
+    MBCType mbc = MBC_NONE;
+    bool hasRTC = false;
+
+    u32 romBanks = 0;
+    u32 eramSize = 0;
+
+    // banks currently mapped at 0x0000 and 0x4000
+    u16 lowBank = 0;
+    u16 highBank = 1;
+
+    bool ramEnabled = false;
+    u16 romBank = 1;
+    u8 ramBank = 0;
+    u8 mbc1Upper = 0;
+    bool mbc1Mode = false;
+
+    // MBC3 real time clock, counted in seconds of emulated time since
+    // 'rtcSync' - the latched registers are what the game sees
+    u64 rtcTime = 0;
+    u64 rtcSync = 0;
+    bool rtcHalted = false;
+    bool rtcCarry = false;
+    u8 rtcLatch = 0xFF;
+    u8 rtcLatched[5] = {0};
+
+    void setupMBC();
+    void writeMBC(u16 addr, u8 data);
+    void mapROM();
+    void mapERAM();
 
-    // store old values of DIV and DMA to see if they need updating
-    u8 oldDIV = 0x00;
-    u8 oldDMA = 0x00;
+    void updateRTC();
+    void getRTCRegs(u8 regs[5]);
+    void setRTCReg(int reg, u8 data);
 };
 
 #endif // "mmu.hpp" included
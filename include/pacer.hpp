@@ -0,0 +1,45 @@
+#ifndef PACER_HPP
+#define PACER_HPP
+
+#include "types.hpp"
+#include <time.h>
+
+// keeps a loop running at a fixed rate by sleeping until absolute deadlines,
+// so time spent doing the work (or oversleeping) is never added on to the
+// next period - which also means the thread uses no CPU while it waits
+class Pacer {
+    public:
+    // start counting from now, with a tick every 'period' nanoseconds
+    void start(u64 period);
+
+    // sleep until the next tick is due
+    void wait();
+
+    // how late each wake up was compared to its deadline, in microseconds
+    u64 getTicks();
+    double getMeanError();
+    double getJitter();
+    double getMaxError();
+
+    // ticks that woke up more than a whole period late, and the number of
+    // times the deadlines were given up on and started again from now
+    u64 getLateTicks();
+    u64 getResyncs();
+
+    private:
+    // falling further behind than this means the host can't keep up, so
+    // rather than running flat out to catch up, start again from now
+    static const int MAX_BEHIND = 4;
+
+    timespec next;
+    u64 period = 0;
+
+    u64 ticks = 0;
+    u64 lateTicks = 0;
+    u64 resyncs = 0;
+    double errorSum = 0;
+    double errorSquares = 0;
+    double maxError = 0;
+};
+
+#endif // "pacer.hpp" included
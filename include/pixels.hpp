@@ -0,0 +1,29 @@
+#ifndef PIXELS_HPP
+#define PIXELS_HPP
+
+#include "types.hpp"
+
+// the PPU's per-pixel work, with SSE2 and AVX2 versions picked at runtime
+// based on what the host CPU supports (and a plain C++ version for anything
+// else)
+namespace Pixels {
+    struct Kernels {
+        const char *name;
+
+        // expand a tile's 16 bytes of bitplanes into 64 palette indices
+        void (*decodeTile)(const u8 *data, u8 *out);
+
+        // look up 'count' palette indices (0 - 3) in a palette of 4 pixels
+        void (*mapPalette)(const u8 *indices, const u32 *palette, u32 *out,
+                           int count);
+    };
+
+    // the best kernels for this CPU
+    const Kernels &get();
+
+    // force a particular set of kernels ("scalar", "sse2" or "avx2") - false
+    // if they aren't supported here
+    bool use(const char *name);
+}
+
+#endif // "pixels.hpp" included
@@ -0,0 +1,104 @@
+#ifndef PPU_HPP
+#define PPU_HPP
+
+#include "mmu.hpp"
+#include "scheduler.hpp"
+#include "state.hpp"
+#include "types.hpp"
+#include "utils.hpp"
+
+// pack a colour into a pixel, with the bytes in R, G, B, A order in memory
+// (on a little endian host) as SFML textures expect
+constexpr u32 rgba(u8 r, u8 g, u8 b) {
+    return r | (g << 8) | (b << 16) | (0xFFu << 24);
+}
+
+// the pixel processing unit, which draws the screen a line at a time - each
+// line is 80 cycles of OAM search (mode 2), 172 cycles of drawing (mode 3)
+// and 204 of HBLANK (mode 0), followed by 10 lines of VBLANK (mode 1). The
+// whole line is rendered in one go at the end of mode 3.
+class PPU {
+    public:
+    static const int WIDTH = 160;
+    static const int HEIGHT = 144;
+
+    static const int CYCLES_PER_LINE = 456;
+    static const int OAM_CYCLES = 80;
+    static const int DRAW_CYCLES = 172;
+    static const int LINES = 154;
+
+    void bindMMU(MMU *target);
+    void bindScheduler(Scheduler *target);
+
+    // set the registers to their state after the boot ROM and start the
+    // first line - the scheduler and MMU must be bound first
+    void reset();
+
+    // event handlers for the mode changes within a line
+    void endOAMScan(u64 when);
+    void endDrawing();
+    void endLine(u64 when);
+
+    // called by the MMU when the LCD registers are written to
+    void updateLCDC();
+    void updateSTAT();
+
+    // called by the MMU whenever tile data (0x8000 - 0x97FF) is written to,
+    // so the tile is decoded again next time it is drawn
+    void invalidateTile(u16 addr) {
+        tileDirty[(addr - 0x8000) >> 4] = true;
+    }
+    void invalidateTiles();
+
+    // the most recently drawn frame, as 160x144 RGBA pixels
+    const u32 *getFrame();
+
+    // turn drawing pixels on or off - the timing of each line (and so LY,
+    // STAT and the interrupts) carries on regardless, but the frame isn't
+    // touched, so frames that won't be seen cost next to nothing
+    void setRendering(bool enabled);
+
+    void saveState(State::Writer &out);
+    bool loadState(State::Reader &in);
+
+    private:
+    struct SavedState {
+        u8 windowLine;
+        bool statLine;
+    };
+
+    MMU *mmu;
+    Scheduler *sched;
+
+    u32 frame[WIDTH * HEIGHT] = {0};
+    bool rendering = true;
+
+    // every tile in VRAM, decoded from its two bitplanes into a palette
+    // index (0 - 3) per pixel
+    u8 tiles[384][8][8];
+    bool tileDirty[384];
+
+    // the line of the window drawn next - it only moves on for lines where
+    // the window was actually visible
+    u8 windowLine = 0;
+
+    // the STAT interrupt is requested when any of its enabled sources
+    // becomes active, but not again until all of them have gone inactive
+    bool statLine = false;
+
+    void startLine(u64 when);
+
+    const u8 *getTileRow(int tile, int row);
+    void decodeTile(int tile);
+
+    void setMode(int mode);
+    void checkSTAT();
+
+    void disable();
+    void renderLine(int line);
+    void renderBackground(int line, u8 *indices);
+    void renderWindow(int line, u8 *indices);
+    void renderSprites(int line, const u8 *indices, u32 *out);
+};
+
+#endif // "ppu.hpp" included
@@ -0,0 +1,97 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include "types.hpp"
+#include <array>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// counts where the guest program spends its time - how often each op (by
+// ROM bank and address) runs and how many cycles it takes, totals for each
+// opcode, how often each conditional branch is taken, and the cycles spent
+// in each chain of calls. The calls are followed with a shadow stack kept
+// alongside the real one, pushed by CALL, RST and interrupts and popped by
+// whichever RET brings SP back above where a call pushed its return
+// address, so code that drops or fakes return addresses doesn't throw it
+// out of step for long.
+//
+// Only built in with 'make PROFILE=1' - otherwise the CPU has no hooks at
+// all, so it costs nothing.
+class Profiler {
+    public:
+    Profiler();
+
+    // an op run from 'pc' in ROM bank 'bank' ('op' is 0x100 + the second
+    // byte for CB ops) - for conditional branches, 'taken' says which way
+    // it went
+    void countOp(u16 bank, u16 pc, u16 op, int cycles, bool branch,
+                 bool taken);
+
+    // cycles spent halted, waiting for an interrupt
+    void countHalt(int cycles);
+
+    // a call (or interrupt) to 'pc' in 'bank', pushing its return address
+    // below 'sp'
+    void enter(u16 bank, u16 pc, u16 sp);
+
+    // a return, leaving SP at 'sp'
+    void leave(u16 sp);
+
+    // the hottest addresses, opcodes and branches, most cycles first
+    void writeReport(std::ostream &out, int top = 40);
+
+    // one line per call chain, as 'caller;callee cycles' - the input
+    // flamegraph.pl and similar tools expect
+    void writeFolded(std::ostream &out);
+
+    private:
+    struct Site {
+        u64 count;
+        u64 cycles;
+        u64 taken;
+        u16 op;
+        bool branch;
+    };
+
+    // a node in the tree of call chains
+    struct Node {
+        u16 bank;
+        u16 pc;
+        u32 parent;
+        u64 cycles;
+        u64 halted;
+    };
+
+    struct Frame {
+        u32 node;
+        u16 sp;
+    };
+
+    // sites are kept in pages of 0x4000 addresses, one for each bank of each
+    // quarter of the address space, only allocated once something runs there
+    typedef std::array<Site, 0x4000> Page;
+    std::vector<std::unique_ptr<Page>> pages;
+
+    u64 opCounts[0x200] = {};
+    u64 opCycles[0x200] = {};
+    u64 totalCycles = 0;
+    u64 haltedCycles = 0;
+
+    // node 0 is the root, for code run before any call
+    std::vector<Node> nodes;
+    std::map<std::pair<u32, u32>, u32> children;
+    std::vector<Frame> stack;
+    u32 current = 0;
+
+    // deeper chains than this are counted against the deepest call
+    static const size_t MAX_DEPTH = 256;
+
+    Site &getSite(u16 bank, u16 pc);
+    std::string getName(u16 bank, u16 pc);
+    std::string getOpName(u16 op);
+};
+
+#endif // "profiler.hpp" included
@@ -0,0 +1,34 @@
+#ifndef REGISTERS_HPP
+#define REGISTERS_HPP
+
+#include "types.hpp"
+
+// the CPU's register file, laid out as the 16-bit pairs that ops load,
+// store and step as a whole, each of which also holds its two 8-bit
+// registers - so a pair is a single load or store, rather than being built
+// from (or split into) its halves every time. The halves are ordered to
+// match the host's byte order, so the high register is always the top byte
+// of the pair.
+//
+// F is only kept up to date here when something reads AF as a whole (the
+// CPU works its flags out as they are needed - see cpu.hpp), so it should
+// be filled in from the CPU before the file is copied anywhere.
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define REGISTER_PAIR(pair, hi, lo) union { u16 pair; struct { u8 hi, lo; }; }
+#else
+#define REGISTER_PAIR(pair, hi, lo) union { u16 pair; struct { u8 lo, hi; }; }
+#endif
+
+struct Registers {
+    REGISTER_PAIR(AF, A, F);
+    REGISTER_PAIR(BC, B, C);
+    REGISTER_PAIR(DE, D, E);
+    REGISTER_PAIR(HL, H, L);
+    u16 SP, PC;
+};
+
+#undef REGISTER_PAIR
+
+static_assert(sizeof(Registers) == 12, "registers should be packed");
+
+#endif // "registers.hpp" included
@@ -0,0 +1,59 @@
+#ifndef REWIND_HPP
+#define REWIND_HPP
+
+#include "mmu.hpp"
+#include "types.hpp"
+#include <cstring>
+#include <deque>
+#include <vector>
+
+// a history of snapshots kept in a fixed size ring buffer - rather than a
+// copy of all RAM, each snapshot only stores the chunks of RAM that changed
+// since the one before it (their old contents, so that stepping back from
+// one snapshot to the previous just means copying those chunks back in)
+class Rewind {
+    public:
+    void bindMMU(MMU *target);
+
+    // start recording into a ring buffer of the given size
+    void setup(size_t capacity);
+    bool isEnabled();
+
+    // record a snapshot, given the rest of the machine state
+    void push(const std::vector<u8> &core);
+
+    // restore RAM to the most recent snapshot and drop it, returning the
+    // rest of its state through 'core' - false if there are none left
+    bool pop(std::vector<u8> &core);
+
+    // number of snapshots held, and the bytes of the ring they take up
+    size_t getCount();
+    size_t getUsed();
+
+    private:
+    MMU *mmu = nullptr;
+
+    // copy of RAM as of the newest snapshot
+    std::vector<u8> shadow;
+
+    struct EntryHeader {
+        u32 coreSize;
+        u32 chunkCount;
+    };
+
+    struct Entry {
+        size_t offset;
+        size_t size;
+    };
+
+    std::vector<u8> ring;
+    std::deque<Entry> entries;
+    size_t writePos = 0;
+
+    // scratch list of chunks that changed, kept to avoid reallocating
+    std::vector<u32> changed;
+
+    u8 *allocate(size_t size);
+};
+
+#endif // "rewind.hpp" included
@@ -0,0 +1,68 @@
+#ifndef RINGBUFFER_HPP
+#define RINGBUFFER_HPP
+
+#include "types.hpp"
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// a fixed size queue between exactly one writer thread and one reader
+// thread, which never locks - each side only ever moves its own index on,
+// after it has finished with the items it is handing over
+template <typename T>
+class RingBuffer {
+    public:
+    // the capacity is rounded up to a power of two
+    RingBuffer(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+        items.resize(size);
+        mask = size - 1;
+    }
+
+    // add up to 'count' items, returning how many fitted
+    size_t push(const T *data, size_t count) {
+        size_t tail = writePos.load(std::memory_order_relaxed);
+        size_t head = readPos.load(std::memory_order_acquire);
+        count = std::min(count, items.size() - (tail - head));
+
+        for (size_t i = 0; i < count; i++) {
+            items[(tail + i) & mask] = data[i];
+        }
+        writePos.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    // take up to 'count' items, returning how many there were
+    size_t pop(T *data, size_t count) {
+        size_t head = readPos.load(std::memory_order_relaxed);
+        size_t tail = writePos.load(std::memory_order_acquire);
+        count = std::min(count, tail - head);
+
+        for (size_t i = 0; i < count; i++) {
+            data[i] = items[(head + i) & mask];
+        }
+        readPos.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    // number of items waiting to be read (which may be out of date as soon
+    // as it is returned)
+    size_t size() {
+        return writePos.load(std::memory_order_acquire) -
+               readPos.load(std::memory_order_acquire);
+    }
+
+    private:
+    std::vector<T> items;
+    size_t mask;
+
+    // both indices count up forever, and are only wrapped when used - kept
+    // on separate cache lines so the two sides don't fight over one
+    alignas(64) std::atomic<size_t> writePos{0};
+    alignas(64) std::atomic<size_t> readPos{0};
+};
+
+#endif // "ringbuffer.hpp" included
@@ -0,0 +1,74 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include "state.hpp"
+#include "types.hpp"
+#include <functional>
+#include <queue>
+#include <vector>
+
+// everything that can happen at a known time in the future - each event can
+// only be pending once, so scheduling it again replaces the old deadline
+enum class Event : u8 {
+    TIMAOverflow,
+    DMADone,
+    OAMScanDone,
+    DrawDone,
+    LineDone,
+    SerialDone,
+    COUNT
+};
+
+class Scheduler {
+    public:
+    // master cycle counter, counting up from power on
+    u64 now = 0;
+
+    void reset();
+
+    // schedule an event to happen at the given (absolute) cycle
+    void schedule(Event ev, u64 when);
+    void cancel(Event ev);
+    bool isPending(Event ev);
+
+    // cycle of the earliest pending event
+    u64 nextDeadline();
+
+    // remove the earliest event if it is due and return it through 'ev',
+    // along with the cycle it was due at (which may be slightly in the past,
+    // and is what any follow-up events should be scheduled relative to)
+    bool popDue(Event &ev, u64 &when);
+
+    // save / restore the cycle counter and every pending event
+    void saveState(State::Writer &out);
+    bool loadState(State::Reader &in);
+
+    private:
+    struct SavedState {
+        u64 now;
+        bool pending[(int)Event::COUNT];
+        u64 deadline[(int)Event::COUNT];
+    };
+
+    struct Entry {
+        u64 when;
+        Event ev;
+        u32 generation;
+
+        bool operator>(const Entry &other) const {
+            return when > other.when;
+        }
+    };
+
+    // entries are never removed from the middle of the heap - cancelling or
+    // rescheduling an event bumps its generation so that any stale entries
+    // are dropped once they reach the top
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+    u32 generation[(int)Event::COUNT] = {0};
+    bool pending[(int)Event::COUNT] = {false};
+    u64 deadline[(int)Event::COUNT] = {0};
+
+    void dropStale();
+};
+
+#endif // "scheduler.hpp" included
@@ -0,0 +1,76 @@
+#ifndef STATE_HPP
+#define STATE_HPP
+
+#include "types.hpp"
+#include <cstring>
+#include <vector>
+
+// save states are a header followed by each component's state, copied back
+// to back in one pass - components describe their state as plain structs so
+// that each one is a single memcpy
+namespace State {
+    // bumped whenever the layout of any component's state changes
+    static const u32 MAGIC = 0x53504247;   // "GBPS"
+    static const u32 VERSION = 6;
+
+    struct Header {
+        u32 magic;
+        u32 version;
+        u32 size;
+        u16 romChecksum;
+        bool withRAM;
+    };
+
+    class Writer {
+        public:
+        Writer(std::vector<u8> &target) : buf(target) {}
+
+        template <typename T>
+        void write(const T &val) {
+            write(&val, sizeof(T));
+        }
+
+        void write(const void *data, size_t size) {
+            // the buffer is only grown, so reusing one avoids reallocating
+            if (buf.size() < pos + size) {
+                buf.resize(pos + size);
+            }
+            memcpy(buf.data() + pos, data, size);
+            pos += size;
+        }
+
+        size_t size() {
+            return pos;
+        }
+
+        private:
+        std::vector<u8> &buf;
+        size_t pos = 0;
+    };
+
+    class Reader {
+        public:
+        Reader(const u8 *data, size_t size) : data(data), end(data + size) {}
+
+        // returns false (and reads nothing) if the state is too short
+        template <typename T>
+        bool read(T &val) {
+            return read(&val, sizeof(T));
+        }
+
+        bool read(void *target, size_t size) {
+            if ((size_t)(end - data) < size) {
+                return false;
+            }
+            memcpy(target, data, size);
+            data += size;
+            return true;
+        }
+
+        private:
+        const u8 *data;
+        const u8 *end;
+    };
+};
+
+#endif // "state.hpp" included
@@ -0,0 +1,59 @@
+#ifndef STEPBUFFER_HPP
+#define STEPBUFFER_HPP
+
+#include "types.hpp"
+#include <vector>
+
+// turns a signal described only by the times and sizes of its steps into
+// samples, without aliasing - rather than stepping straight from one level
+// to the next, each step is drawn as a band limited one (looked up from a
+// table by where between two samples it falls). The buffer holds the
+// differences between samples, so adding a step costs the same however
+// long the signal then stays at the new level, and the samples are only
+// summed up once they are read out.
+class StepBuffer {
+    public:
+    // 'clockRate' is the rate that step times are counted in
+    StepBuffer(u32 clockRate, u32 sampleRate, u32 maxSamples);
+
+    // add a step of 'delta' at the given clock time, which must not be
+    // before the last time passed to endFrame()
+    void addDelta(u64 time, int delta);
+
+    // make all samples before the given time ready to be read
+    void endFrame(u64 time);
+
+    // number of samples ready to be read
+    u32 getAvailable();
+
+    // read out up to 'count' samples, each 'stride' apart in 'out'
+    u32 read(s16 *out, u32 count, int stride);
+
+    // forget everything buffered and start again from the given time
+    void clear(u64 time);
+
+    private:
+    // positions are counted in samples, as fixed point with 20 fractional
+    // bits, of which the top 5 choose one of 32 steps in the kernel table
+    static const int FRAC_BITS = 20;
+    static const int PHASE_BITS = 5;
+    static const int PHASES = 1 << PHASE_BITS;
+
+    // each step is spread across this many samples
+    static const int TAPS = 16;
+
+    // step sizes are scaled up by this much for the integer kernel
+    static const int KERNEL_BITS = 15;
+
+    u64 factor;
+    u64 start = 0;     // (fixed point) position of buffer[0]
+    u32 available = 0;
+
+    std::vector<s32> buffer;
+    s32 sum = 0;
+
+    // the kernel for each phase, which sums to 1 << KERNEL_BITS
+    s32 kernel[PHASES][TAPS];
+};
+
+#endif // "stepbuffer.hpp" included
@@ -0,0 +1,55 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// a fixed set of worker threads, each with its own queue of tasks - workers
+// take from the back of their own queue and, once it is empty, steal from
+// the front of everyone else's, so no thread sits idle while work remains
+class ThreadPool {
+    public:
+    // 0 threads means one per core
+    ThreadPool(unsigned threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // queue a task - tasks are handed out to the queues in turn
+    void submit(std::function<void()> task);
+
+    // block until every submitted task has finished
+    void wait();
+
+    unsigned size();
+
+    private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    unsigned nextQueue = 0;
+
+    // 'queued' counts tasks sitting in a queue, 'pending' counts those that
+    // also haven't finished yet - both are guarded by 'lock'
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    size_t queued = 0;
+    size_t pending = 0;
+    bool stopping = false;
+
+    void work(unsigned index);
+    std::function<void()> take(unsigned index);
+};
+
+#endif // "threadpool.hpp" included
@@ -0,0 +1,75 @@
+#ifndef TIMER_HPP
+#define TIMER_HPP
+
+#include "mmu.hpp"
+#include "scheduler.hpp"
+#include "state.hpp"
+#include "types.hpp"
+#include "utils.hpp"
+
+// DIV and TIMA are both driven by a 16-bit counter that goes up every cycle:
+// DIV is its top byte, and TIMA goes up whenever the counter bit that TAC
+// selects falls from 1 to 0 (while TAC enables it). Rather than counting
+// either of them as time passes, they are worked out from the time when
+// they're read, and the only event scheduled is for TIMA overflowing.
+class Timer {
+    public:
+    void bindMMU(MMU *target);
+    void bindScheduler(Scheduler *target);
+
+    // start counting from now - the scheduler and MMU must be bound first
+    void reset();
+
+    // the value of DIV or TIMA right now
+    u8 read(u16 addr);
+
+    // called by the MMU when DIV, TIMA, TMA or TAC is written to (once the
+    // new value is in place), with the value TMA or TAC had before
+    void writeDIV();
+    void writeTIMA();
+    void writeTMA(u8 oldTMA);
+    void writeTAC(u8 oldTAC);
+
+    // event handler for TIMA overflowing, which reloads it from TMA
+    void overflow(u64 when);
+
+    // save / restore the counter and TIMA
+    void saveState(State::Writer &out);
+    bool loadState(State::Reader &in);
+
+    private:
+    struct SavedState {
+        u64 divStart;
+        u64 timaSync;
+        u8 tima;
+    };
+
+    MMU *mmu;
+    Scheduler *sched;
+
+    // the cycle the counter was last reset on
+    u64 divStart = 0;
+
+    // TIMA was 'tima' on cycle timaSync, and has gone up once for every
+    // falling edge of TAC's counter bit since then
+    u64 timaSync = 0;
+    u8 tima = 0;
+
+    // cycles between falling edges of the counter bit the given TAC
+    // selects, or 0 if it doesn't enable TIMA
+    static int getTIMAPeriod(u8 TAC);
+
+    // bring TIMA up to 'time', with the given TAC, reloading it from the
+    // given TMA if it overflows on the way
+    void syncTIMA(u64 time, u8 TAC, u8 TMA);
+
+    // TIMA has overflowed at 'when', and is reloaded from the given TMA
+    void overflow(u64 when, u8 TMA);
+
+    // TIMA has gone up by one without waiting for an edge
+    void bumpTIMA();
+
+    void scheduleOverflow();
+};
+
+#endif // "timer.hpp" included
@@ -0,0 +1,81 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include "registers.hpp"
+#include "types.hpp"
+#include <string>
+#include <vector>
+
+// a record of the last ops the CPU ran, with the registers as they were
+// just before each one, kept in a fixed size ring buffer. Entries are 16
+// bytes written straight into the ring, so nothing is allocated or
+// formatted while running - the ring is only written out (oldest entry
+// first) when asked, and turned into text by gbpp-trace.
+//
+// Only built in with 'make TRACE=1' - otherwise the CPU has no hooks for it.
+class Trace {
+    public:
+    static const u32 MAGIC = 0x52544247;   // "GBTR"
+    static const u32 VERSION = 2;
+
+    struct Entry {
+        // low 24 bits of the cycle the op started on, with the opcode in
+        // the bottom 8 bits (0xCB for all CB ops)
+        u32 stamp;
+        Registers regs;
+    };
+
+    // the low nibble of F is always 0, so it holds IME instead
+    static const u8 IME_BIT = 0x01;
+
+    // a trace file is this header followed by the entries, oldest first
+    struct Header {
+        u32 magic;
+        u32 version;
+        u64 count;
+
+        // the full cycle that the newest entry started on, from which the
+        // others are worked out
+        u64 endTime;
+    };
+
+    // start recording into a ring of the given number of entries (rounded
+    // up to a power of two)
+    void setup(size_t entries);
+    bool isEnabled();
+
+    // the cycle that the CPU's next run starts on
+    void setTime(u64 time) {
+        now = time;
+    }
+
+    // the entry for an op starting 'offset' cycles into the current run,
+    // for the CPU to fill in the rest of
+    Entry &add(int offset, u8 op) {
+        last = now + offset;
+        Entry &entry = ring[count++ & mask];
+        entry.stamp = (u32)last << 8 | op;
+        return entry;
+    }
+
+    // number of entries held
+    size_t getCount();
+
+    bool write(const std::string &path);
+
+    // read a trace file, along with the full cycle each entry started on
+    static bool read(const std::string &path, std::vector<Entry> &entries,
+                     std::vector<u64> &times);
+
+    private:
+    std::vector<Entry> ring;
+    size_t mask = 0;
+    u64 count = 0;
+
+    u64 now = 0;
+    u64 last = 0;
+};
+
+static_assert(sizeof(Trace::Entry) == 16, "trace entries should be packed");
+
+#endif // "trace.hpp" included
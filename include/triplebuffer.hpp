@@ -0,0 +1,57 @@
+#ifndef TRIPLEBUFFER_HPP
+#define TRIPLEBUFFER_HPP
+
+#include "types.hpp"
+#include <atomic>
+
+// hands values from one writer thread to one reader thread without either
+// ever waiting on the other - the writer fills in the back buffer and swaps
+// it with the middle one, and the reader swaps the middle one with the front
+// buffer whenever a new value has been published there. Values can be
+// skipped if the writer is faster, but the reader always sees the newest.
+template <typename T>
+class TripleBuffer {
+    public:
+    // the buffer for the writer to fill in next
+    T &getBack() {
+        return buffers[back];
+    }
+
+    // make the back buffer the newest value
+    void publish() {
+        u8 old = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+        back = old & INDEX;
+    }
+
+    // move the newest value to the front, if there has been one published
+    // since the last call
+    bool update() {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH)) {
+            return false;
+        }
+        u8 old = middle.exchange(front, std::memory_order_acq_rel);
+        front = old & INDEX;
+        return true;
+    }
+
+    // the buffer for the reader to use
+    const T &getFront() {
+        return buffers[front];
+    }
+
+    private:
+    // the middle index is flagged when it holds a value the reader hasn't
+    // taken yet
+    static const u8 INDEX = 0x03;
+    static const u8 FRESH = 0x04;
+
+    T buffers[3];
+
+    // each side's index is kept on its own cache line, so the two threads
+    // only ever touch the same line when swapping
+    alignas(64) u8 back = 0;
+    alignas(64) std::atomic<u8> middle{1};
+    alignas(64) u8 front = 2;
+};
+
+#endif // "triplebuffer.hpp" included
@@ -0,0 +1,469 @@
+#include "apu.hpp"
+#include <algorithm>
+
+// each channel's registers are 5 apart, starting with NR10, NR20 (which
+// doesn't exist), NR30 and NR40 (which doesn't exist either) - they're read
+// with getRef(), since reading them with read8() would catch the APU up again
+static u16 getReg(int channel, int n) {
+    return MMU::NR10 + channel * 5 + n;
+}
+
+// the waveform of each square wave duty cycle, one bit per step
+static const u8 DUTY[4] = {0x01, 0x81, 0x87, 0x7E};
+
+// noise channel clock divisors, selected by NR43 bits 0 - 2
+static const int DIVISORS[8] = {8, 16, 32, 48, 64, 80, 96, 112};
+
+// bits of NR10 - NR52 that can't be read back, and so read as 1s, followed
+// by the addresses up to wave RAM, which aren't registers at all
+static const u8 READ_MASKS[] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF,   // NR10 - NR14
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,   // NR20 - NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,   // NR30 - NR34
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,   // NR40 - NR44
+    0x00, 0x00, 0x70,               // NR50 - NR52
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+// output levels are scaled up by this much to fill out the sample range -
+// four channels at full volume on one side comes to 4 * 15 * 8 * 60
+static const int AMPLITUDE = 60;
+
+APU::APU() :
+    left(4194304, SAMPLE_RATE, 4096),
+    right(4194304, SAMPLE_RATE, 4096),
+    output(16384) {
+}
+
+void APU::bindMMU(MMU *target) {
+    mmu = target;
+}
+
+void APU::bindScheduler(Scheduler *target) {
+    sched = target;
+}
+
+void APU::reset() {
+    // register values left behind by the boot ROM (with its beep finished)
+    static const u8 regs[] = {
+        0x80, 0xBF, 0xF3, 0xFF, 0xBF,   // NR10 - NR14
+        0xFF, 0x3F, 0x00, 0xFF, 0xBF,   // NR20 - NR24
+        0x7F, 0xFF, 0x9F, 0xFF, 0xBF,   // NR30 - NR34
+        0xFF, 0xFF, 0x00, 0x00, 0xBF,   // NR40 - NR44
+        0x77, 0xF3, 0xF0                // NR50 - NR52
+    };
+    for (u16 i = 0; i < sizeof(regs); i++) {
+        mmu->getRef(MMU::NR10 + i) = regs[i];
+    }
+
+    for (int i = 0; i < 4; i++) {
+        channels[i] = Channel();
+        updatePeriod(i);
+    }
+    channels[0].dac = true;
+    channels[3].lfsr = 0x7FFF;
+
+    sweepEnabled = false;
+    sweepTimer = 0;
+    sweepFrequency = 0;
+    sequencerStep = 0;
+
+    time = sched->now;
+    nextSequencer = time + SEQUENCER_PERIOD;
+    left.clear(time);
+    right.clear(time);
+    levels[0] = levels[1] = 0;
+    mix(time);
+}
+
+void APU::write(u16 addr, u8 data) {
+    // the registers between NR52 and wave RAM don't exist, so writes to
+    // them go nowhere
+    if (addr > MMU::NR52 && addr < MMU::WAVE) {
+        return;
+    }
+
+    // everything up to now happened with the old value
+    catchUp();
+
+    u8 &reg = mmu->getRef(addr);
+    bool powered = Utils::getBit(mmu->getRef(MMU::NR52), 7);
+
+    // wave RAM is plain memory, though the wave channel may be playing it
+    if (addr >= MMU::WAVE) {
+        reg = data;
+        updateOutput(2);
+        mix(time);
+        return;
+    }
+
+    // only bit 7 of NR52 can be written, and while the power is off every
+    // other register is read only
+    if (addr == MMU::NR52) {
+        reg = (data & 0x80) | (reg & 0x7F);
+        if (!Utils::getBit(data, 7)) {
+            powerOff();
+        } else if (!powered) {
+            sequencerStep = 0;
+            nextSequencer = time + SEQUENCER_PERIOD;
+        }
+        updateStatus();
+        mix(time);
+        return;
+    }
+    if (!powered) {
+        return;
+    }
+    reg = data;
+
+    if (addr == MMU::NR50 || addr == MMU::NR51) {
+        mix(time);
+        return;
+    }
+
+    int index = (addr - MMU::NR10) / 5;
+    Channel &ch = channels[index];
+    switch ((addr - MMU::NR10) % 5) {
+        // only the wave channel has its DAC switched with a bit of its own
+        case 0:
+            if (index == 2) {
+                ch.dac = Utils::getBit(data, 7);
+                ch.enabled &= ch.dac;
+            }
+            break;
+
+        case 1:
+            if (index == 2) {
+                ch.length = 256 - data;
+            } else {
+                ch.length = 64 - (data & 0x3F);
+            }
+            break;
+
+        // the other channels' DACs are on unless the envelope would keep
+        // them silent
+        case 2:
+            if (index != 2) {
+                ch.dac = (data & 0xF8) != 0;
+                ch.enabled &= ch.dac;
+            }
+            break;
+
+        case 3:
+            updatePeriod(index);
+            break;
+
+        case 4:
+            ch.lengthEnabled = Utils::getBit(data, 6);
+            updatePeriod(index);
+            if (Utils::getBit(data, 7)) {
+                trigger(index);
+            }
+            break;
+    }
+
+    updateOutput(index);
+    updateStatus();
+    mix(time);
+}
+
+u8 APU::read(u16 addr) {
+    catchUp();
+
+    // wave RAM reads back exactly what was written
+    u8 value = mmu->getRef(addr);
+    if (addr < MMU::WAVE) {
+        value |= READ_MASKS[addr - MMU::NR10];
+    }
+    return value;
+}
+
+void APU::catchUp() {
+    catchUp(mmu->getTime());
+}
+
+void APU::endFrame() {
+    catchUp(sched->now);
+    left.endFrame(time);
+    right.endFrame(time);
+
+    u32 count = std::min(left.getAvailable(), right.getAvailable());
+    samples.resize(count * 2);
+    left.read(samples.data(), count, 2);
+    right.read(samples.data() + 1, count, 2);
+    output.push(samples.data(), samples.size());
+}
+
+RingBuffer<s16> &APU::getOutput() {
+    return output;
+}
+
+void APU::saveState(State::Writer &out) {
+    // cleared first so that padding is always saved the same way
+    SavedState state = {};
+    std::copy(channels, channels + 4, state.channels);
+    state.sweepEnabled = sweepEnabled;
+    state.sweepTimer = sweepTimer;
+    state.sweepFrequency = sweepFrequency;
+    state.sequencerStep = sequencerStep;
+    state.nextSequencer = nextSequencer;
+    state.time = time;
+    out.write(state);
+}
+
+bool APU::loadState(State::Reader &in) {
+    SavedState state;
+    if (!in.read(state)) {
+        return false;
+    }
+    std::copy(state.channels, state.channels + 4, channels);
+    sweepEnabled = state.sweepEnabled;
+    sweepTimer = state.sweepTimer;
+    sweepFrequency = state.sweepFrequency;
+    sequencerStep = state.sequencerStep;
+    nextSequencer = state.nextSequencer;
+    time = state.time;
+
+    // whatever was buffered belongs to a different point in time
+    left.clear(time);
+    right.clear(time);
+    levels[0] = levels[1] = 0;
+    mix(time);
+    return true;
+}
+
+void APU::catchUp(u64 until) {
+    // jump from one change to the next - a channel only changes when it
+    // steps through its waveform, or the frame sequencer clocks it
+    while (true) {
+        u64 when = nextSequencer;
+        int index = -1;
+        for (int i = 0; i < 4; i++) {
+            if (channels[i].enabled && channels[i].next < when) {
+                when = channels[i].next;
+                index = i;
+            }
+        }
+        if (when > until) {
+            break;
+        }
+
+        if (index < 0) {
+            stepSequencer();
+            nextSequencer += SEQUENCER_PERIOD;
+        } else {
+            stepChannel(index);
+            channels[index].next += channels[index].period;
+        }
+        mix(when);
+    }
+    time = until;
+}
+
+void APU::stepSequencer() {
+    // lengths are clocked at 256Hz, the sweep at 128Hz and the envelopes at
+    // 64Hz
+    if (sequencerStep % 2 == 0) {
+        for (Channel &ch : channels) {
+            if (ch.lengthEnabled && ch.length > 0 && --ch.length == 0) {
+                ch.enabled = false;
+            }
+        }
+    }
+    if (sequencerStep == 2 || sequencerStep == 6) {
+        stepSweep();
+    }
+    if (sequencerStep == 7) {
+        for (int i : {0, 1, 3}) {
+            Channel &ch = channels[i];
+            if (ch.envelopePeriod && --ch.envelopeTimer <= 0) {
+                ch.envelopeTimer = ch.envelopePeriod;
+                if (ch.envelopeUp && ch.volume < 15) {
+                    ch.volume++;
+                } else if (!ch.envelopeUp && ch.volume > 0) {
+                    ch.volume--;
+                }
+            }
+        }
+    }
+    sequencerStep = (sequencerStep + 1) % 8;
+
+    for (int i = 0; i < 4; i++) {
+        updateOutput(i);
+    }
+    updateStatus();
+}
+
+void APU::stepChannel(int index) {
+    Channel &ch = channels[index];
+    if (index < 2) {
+        ch.position = (ch.position + 1) % 8;
+    } else if (index == 2) {
+        ch.position = (ch.position + 1) % 32;
+    } else {
+        // shift the LFSR right, feeding back the XOR of its low two bits -
+        // into bit 6 as well in 7 bit mode
+        int bit = (ch.lfsr ^ (ch.lfsr >> 1)) & 1;
+        ch.lfsr = (ch.lfsr >> 1) | (bit << 14);
+        if (Utils::getBit(mmu->getRef(getReg(3, 3)), 3)) {
+            ch.lfsr = (ch.lfsr & ~0x40) | (bit << 6);
+        }
+    }
+    updateOutput(index);
+}
+
+void APU::updateOutput(int index) {
+    Channel &ch = channels[index];
+    if (!ch.enabled) {
+        ch.output = 0;
+        return;
+    }
+
+    if (index < 2) {
+        int duty = mmu->getRef(getReg(index, 1)) >> 6;
+        ch.output = Utils::getBit(DUTY[duty], ch.position) ? ch.volume : 0;
+    } else if (index == 2) {
+        // two samples per byte, high nibble first, shifted down by the
+        // volume code (0 being muted)
+        static const int SHIFTS[4] = {4, 0, 1, 2};
+        u8 samples = mmu->getRef(MMU::WAVE + ch.position / 2);
+        int sample = ch.position % 2 ? samples & 0x0F : samples >> 4;
+        int code = (mmu->getRef(getReg(2, 2)) >> 5) & 0x03;
+        ch.output = sample >> SHIFTS[code];
+    } else {
+        ch.output = ch.lfsr & 1 ? 0 : ch.volume;
+    }
+}
+
+void APU::mix(u64 when) {
+    u8 NR50 = mmu->getRef(MMU::NR50);
+    u8 NR51 = mmu->getRef(MMU::NR51);
+    bool powered = Utils::getBit(mmu->getRef(MMU::NR52), 7);
+
+    for (int side = 0; side < 2; side++) {
+        // NR51 bits 4 - 7 send each channel left, and bits 0 - 3 right
+        int level = 0;
+        for (int i = 0; powered && i < 4; i++) {
+            if (channels[i].dac && Utils::getBit(NR51, side ? i : 4 + i)) {
+                // the DAC turns 0 - 15 into a level either side of 0
+                level += channels[i].output * 2 - 15;
+            }
+        }
+        int volume = (side ? NR50 : NR50 >> 4) & 0x07;
+        level *= (volume + 1) * AMPLITUDE;
+
+        if (level != levels[side]) {
+            (side ? right : left).addDelta(when, level - levels[side]);
+            levels[side] = level;
+        }
+    }
+}
+
+void APU::trigger(int index) {
+    Channel &ch = channels[index];
+    ch.enabled = ch.dac;
+    if (!ch.length) {
+        ch.length = index == 2 ? 256 : 64;
+    }
+    ch.next = time + ch.period;
+    ch.position = 0;
+
+    if (index != 2) {
+        u8 envelope = mmu->getRef(getReg(index, 2));
+        ch.volume = envelope >> 4;
+        ch.envelopeUp = Utils::getBit(envelope, 3);
+        ch.envelopePeriod = envelope & 0x07;
+        ch.envelopeTimer = ch.envelopePeriod;
+    }
+    if (index == 3) {
+        ch.lfsr = 0x7FFF;
+    }
+
+    // the sweep works from a copy of the frequency, and the overflow check
+    // is done straight away
+    if (index == 0) {
+        u8 NR10 = mmu->getRef(MMU::NR10);
+        int period = (NR10 >> 4) & 0x07;
+        int shift = NR10 & 0x07;
+        sweepFrequency = getFrequency(0);
+        sweepTimer = period ? period : 8;
+        sweepEnabled = period || shift;
+        if (shift && getSweepTarget() > 2047) {
+            ch.enabled = false;
+        }
+    }
+}
+
+void APU::updatePeriod(int index) {
+    Channel &ch = channels[index];
+    if (index < 2) {
+        ch.period = (2048 - getFrequency(index)) * 4;
+    } else if (index == 2) {
+        ch.period = (2048 - getFrequency(index)) * 2;
+    } else {
+        u8 NR43 = mmu->getRef(getReg(3, 3));
+        ch.period = DIVISORS[NR43 & 0x07] << (NR43 >> 4);
+    }
+}
+
+int APU::getFrequency(int index) {
+    return ((mmu->getRef(getReg(index, 4)) & 0x07) << 8) |
+           mmu->getRef(getReg(index, 3));
+}
+
+int APU::getSweepTarget() {
+    u8 NR10 = mmu->getRef(MMU::NR10);
+    int delta = sweepFrequency >> (NR10 & 0x07);
+    return Utils::getBit(NR10, 3) ? sweepFrequency - delta
+                                  : sweepFrequency + delta;
+}
+
+void APU::stepSweep() {
+    u8 NR10 = mmu->getRef(MMU::NR10);
+    int period = (NR10 >> 4) & 0x07;
+    if (--sweepTimer > 0) {
+        return;
+    }
+    sweepTimer = period ? period : 8;
+    if (!sweepEnabled || !period) {
+        return;
+    }
+
+    int target = getSweepTarget();
+    if (target > 2047) {
+        channels[0].enabled = false;
+        return;
+    }
+
+    // the new frequency is written back to NR13 / NR14, then checked again
+    if (NR10 & 0x07) {
+        sweepFrequency = target;
+        mmu->getRef(MMU::NR13) = target & 0xFF;
+        u8 &NR14 = mmu->getRef(MMU::NR14);
+        NR14 = (NR14 & ~0x07) | (target >> 8);
+        updatePeriod(0);
+        if (getSweepTarget() > 2047) {
+            channels[0].enabled = false;
+        }
+    }
+}
+
+void APU::powerOff() {
+    for (u16 addr = MMU::NR10; addr < MMU::NR52; addr++) {
+        mmu->getRef(addr) = 0;
+    }
+    for (Channel &ch : channels) {
+        ch.enabled = false;
+        ch.dac = false;
+        ch.output = 0;
+    }
+}
+
+void APU::updateStatus() {
+    // bits 0 - 3 of NR52 show which channels are playing
+    u8 &NR52 = mmu->getRef(MMU::NR52);
+    NR52 = (NR52 & 0x80) | 0x70;
+    for (int i = 0; i < 4; i++) {
+        Utils::setBit(NR52, i, channels[i].enabled);
+    }
+}
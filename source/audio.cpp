@@ -0,0 +1,30 @@
+#ifndef HEADLESS
+#include "audio.hpp"
+
+AudioStream::AudioStream(RingBuffer<s16> &source, unsigned sampleRate) :
+    source(source), chunk(CHUNK_SIZE * 2, 0) {
+    initialize(2, sampleRate);
+}
+
+bool AudioStream::onGetData(Chunk &data) {
+    // if the emulator has fallen behind, hold the last sample rather than
+    // stopping - stopping and starting again would click much louder
+    size_t count = source.pop(chunk.data(), chunk.size());
+    if (count >= 2) {
+        last[0] = chunk[count - 2];
+        last[1] = chunk[count - 1];
+    }
+    for (size_t i = count; i < chunk.size(); i += 2) {
+        chunk[i] = last[0];
+        chunk[i + 1] = last[1];
+    }
+
+    data.samples = chunk.data();
+    data.sampleCount = chunk.size();
+    return true;
+}
+
+void AudioStream::onSeek(sf::Time offset) {
+    // the stream is live, so there is nowhere to seek to
+}
+#endif
@@ -2,41 +2,150 @@
 
 void CPU::reset() {
     // state of the CPU after the internal boot sequence runs
-    A = 0x01;
-    B = 0x00;
-    C = 0x13;
-    D = 0x00;
-    E = 0xD8;
-    H = 0x01;
-    L = 0x4D;
+    AF = 0x01B0;
+    BC = 0x0013;
+    DE = 0x00D8;
+    HL = 0x014D;
     SP = 0xFFFE;
     PC = 0x0100;
-    setZNHC(true, false, true, true);
+    setF(F);
+
+    // a new ROM may have been loaded, so drop any cached code
+    codeCache.clear();
 }
 
 void CPU::bindMMU(MMU *target) {
     mmu = target;
 }
 
-int CPU::run() {
+int CPU::step() {
+    // a halted CPU does nothing until an interrupt occurs
+    if (halt) {
+        return 4;
+    }
+
+    // only code that can't be cached in a block is run a step at a time, so
+    // it's decoded afresh every time
+    Instr in = decode(PC);
+
+    #ifdef TRACE
+    traceOp(in, 0);
+    #endif
+
+    #ifdef PROFILE
+    u16 pc = PC;
+    u16 bank = getProfileBank(pc);
+    #endif
+
+    // PC is moved past the op before it runs, so jumps and calls can simply
+    // overwrite it or push it as the return address
     extraCycles = 0;
-    u8 op = mmu->read8(PC);
+    PC += in.length;
+    (this->*in.fn)(in.imm);
 
-    // check for 0xCB prefixed opcodes
-    if (op == 0xCB) {
-        u8 cb = mmu->read8(PC + 1);
-        execCB(cb);
-    } else {
-        exec(op);
+    #ifdef PROFILE
+    profile(in, bank, pc);
+    #endif
+
+    // return cycles taken to be used by the timers
+    return in.cycles + extraCycles;
+}
+
+int CPU::run(int budget) {
+    if (halt) {
+        return 4;
     }
 
-    if (!branched) {
-        PC += getPCOffset(op);
+    // code outside of ROM isn't cached, so run it one op at a time
+    const Block *block = getBlock();
+    if (!block) {
+        return step();
     }
-    branched = false;
 
-    // return cycles taken to be used by the timers
-    return getCycleCount(op) + extraCycles;
+    // only the last op of a block can branch, so extra cycles are only
+    // ever added once
+    extraCycles = 0;
+
+    // for a polling loop, keep the registers it started with, to see if
+    // going round changed them
+    bool polling = block->polling && idleSkip;
+    SavedState before;
+    u32 liveReads = mmu->liveReads;
+    if (polling) {
+        before = getRegisters();
+    }
+
+    // run the block as a chain of handlers, stopping early if the budget is
+    // spent, or if an op maps in a different ROM bank (which may have been
+    // the one the rest of the block came from)
+    u32 mapVersion = mmu->romMapVersion;
+    int cycles = 0;
+    size_t ran = 0;
+    running = block;
+    runningStart = PC;
+    for (const Instr &in : block->ops) {
+        if (cycles >= budget) {
+            break;
+        }
+        ran++;
+
+        #ifdef TRACE
+        traceOp(in, cycles);
+        #endif
+
+        #ifdef PROFILE
+        u16 pc = PC;
+        u16 bank = getProfileBank(pc);
+        #endif
+
+        PC += in.length;
+        (this->*in.fn)(in.imm);
+        cycles += in.cycles;
+
+        #ifdef PROFILE
+        profile(in, bank, pc);
+        #endif
+
+        if (mmu->romMapVersion != mapVersion) {
+            break;
+        }
+    }
+    cycles += extraCycles;
+    running = nullptr;
+
+    // a loop which only reads memory, and came back round with every
+    // register as it was, will go round in exactly the same way until
+    // something else changes memory or requests an interrupt - which only
+    // happens at events, and the budget never runs past the next one - so
+    // the rest of the budget can be spent going round it all at once (unless
+    // it read the timer or the APU, which change between events)
+    if (polling && ran == block->ops.size() && cycles < budget &&
+        mmu->liveReads == liveReads && isUnchanged(before)) {
+        cycles += (budget - cycles) / cycles * cycles;
+    }
+    return cycles;
+}
+
+int CPU::getRunCycles() {
+    // PC is moved past each op before it runs, so the op being run is the
+    // one that ends at PC - and only ops before it have used up cycles
+    if (!running) {
+        return 0;
+    }
+    u16 end = runningStart;
+    int cycles = 0;
+    for (const Instr &in : running->ops) {
+        end += in.length;
+        if (end == PC) {
+            break;
+        }
+        cycles += in.cycles;
+    }
+    return cycles;
+}
+
+void CPU::setIdleSkip(bool enabled) {
+    idleSkip = enabled;
 }
 
 std::string CPU::getState() {
@@ -54,7 +163,7 @@ std::string CPU::getState() {
       << "E  " << Utils::formatHex(E, 2) << "\n"
       << "H  " << Utils::formatHex(H, 2) << "\n"
       << "L  " << Utils::formatHex(L, 2) << "\n"
-      << "F  " << flagZ << flagN << flagH << flagC << "\n"
+      << "F  " << getZ() << getN() << getH() << getC() << "\n"
       << "PC " << Utils::formatHex(PC, 4) << "\n"
       << "SP " << Utils::formatHex(SP, 4) << "\n\n"
       << "D8   " << Utils::formatHex(D8, 2) << "\n"
@@ -62,40 +171,42 @@ std::string CPU::getState() {
     return s.str();
 }
 
-void CPU::setZNHC(bool fZ, bool fN, bool fH, bool fC) {
-    setZNH(fZ, fN, fH);
-    flagC = fC;
+void CPU::saveState(State::Writer &out) {
+    out.write(getRegisters());
 }
 
-void CPU::setZNH(bool fZ, bool fN, bool fH) {
-    flagZ = fZ;
-    flagN = fN;
-    flagH = fH;
+CPU::SavedState CPU::getRegisters() {
+    // the register file is copied as a whole, once F is filled in
+    F = getF();
+    SavedState state = {*this, IME, halt};
+    return state;
 }
 
-void CPU::setNHC(bool fN, bool fH, bool fC) {
-    flagN = fN;
-    flagH = fH;
-    flagC = fC;
+bool CPU::isUnchanged(const SavedState &state) {
+    const Registers &regs = state.regs;
+    return A == regs.A && getF() == regs.F && BC == regs.BC &&
+           DE == regs.DE && HL == regs.HL && SP == regs.SP && PC == regs.PC;
 }
 
-int CPU::getPCOffset(u8 op) {
-    if (op == 0xCB) {
-        return 2;
-    } else {
-        return pcOffset[op];
+bool CPU::loadState(State::Reader &in) {
+    SavedState state;
+    if (!in.read(state)) {
+        return false;
     }
+
+    static_cast<Registers &>(*this) = state.regs;
+    setF(F);
+    IME = state.IME;
+    halt = state.halt;
+    return true;
 }
 
-int CPU::getCycleCount(u8 op) {
-    if (op == 0xCB) {
-        // CB opcodes that end in '6' or 'E' take 16 cycles, all others take 8
-        u8 cb = mmu->read8(PC + 1);
-        u8 n2 = cb & 0x0F;
-        return (n2 == 0x06) || (n2 == 0x0E) ? 16 : 8;
-    } else {
-        return cycleCount[op];
-    }
+void CPU::setF(u8 flags) {
+    // each flag's bit moved to where it is looked for
+    flagZsrc = ~flags & 0x80;
+    flagN = flags & 0x40;
+    flagHsrc = flags >> 1 & 0x10;
+    flagCsrc = flags << 4 & 0x100;
 }
 
 void CPU::callIntVector(u16 addr) {
@@ -103,4 +214,80 @@ void CPU::callIntVector(u16 addr) {
     CALL(addr);
     IME = false;
     halt = false;
+
+    #ifdef PROFILE
+    if (profiler) {
+        profiler->enter(getProfileBank(addr), addr, SP + 2);
+    }
+    #endif
+}
+
+#ifdef TRACE
+void CPU::bindTrace(Trace *target) {
+    trace = target;
+}
+
+void CPU::traceOp(const Instr &in, int offset) {
+    if (!trace) {
+        return;
+    }
+
+    Trace::Entry &entry = trace->add(offset, in.op);
+    entry.regs = *this;
+    entry.regs.F = getF() | (IME ? Trace::IME_BIT : 0);
+}
+#endif
+
+#ifdef PROFILE
+void CPU::bindProfiler(Profiler *target) {
+    profiler = target;
+}
+
+u16 CPU::getProfileBank(u16 addr) {
+    // only ROM is banked as far as the profiler is concerned
+    return addr < 0x8000 ? mmu->getROMBank(addr) : 0;
+}
+
+void CPU::profile(const Instr &in, u16 bank, u16 pc) {
+    if (!profiler) {
+        return;
+    }
+
+    // extra cycles are only ever added by a conditional op that was taken
+    bool taken = extraCycles > 0;
+    u16 op = in.op == 0xCB ? 0x100 | in.imm : in.op;
+    bool branch = false;
+    switch (op) {
+        case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+            branch = true;
+            break;
+    }
+    profiler->countOp(bank, pc, op, in.cycles + extraCycles, branch, taken);
+
+    // the return address has already been pushed, so SP + 2 is where it
+    // will be when the call returns
+    switch (op) {
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+            if (!taken) {
+                break;
+            }
+            [[fallthrough]];
+        case 0xCD: case 0xC7: case 0xCF: case 0xD7: case 0xDF:
+        case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+            profiler->enter(getProfileBank(PC), PC, SP + 2);
+            break;
+
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+            if (!taken) {
+                break;
+            }
+            [[fallthrough]];
+        case 0xC9: case 0xD9:
+            profiler->leave(SP);
+            break;
+    }
 }
+#endif
@@ -9,191 +9,177 @@ void CPU::LDaddrsp(u16 addr) {
     mmu->write16(addr, SP);
 }
 
-void CPU::LDhl(u16 val) {
-    Utils::setPair(H, L, val);
-    setZNHC(false, false, true, false);
+void CPU::LDhl(s8 val) {
+    HL = offsetSP(val);
 }
 
-void CPU::LDrr(u8 &hi, u8 &lo, u16 val) {
-    Utils::setPair(hi, lo, val);
-}
-
-void CPU::LDsp(u16 val) {
-    SP = val;
+void CPU::LDrr(u16 &target, u16 val) {
+    target = val;
 }
 
 void CPU::LDD(u8 &target, u8 val) {
     target = val;
-    DECrr(H, L);
+    HL--;
 }
 
 void CPU::LDI(u8 &target, u8 val) {
     target = val;
-    INCrr(H, L);
+    HL++;
 }
 
-void CPU::PUSH(u8 hi, u8 lo) {
+void CPU::PUSH(u16 val) {
     SP -= 2;
-    mmu->write16(SP, Utils::getPair(hi, lo));
+    mmu->write16(SP, val);
 }
 
 void CPU::PUSHaf() {
-    // construct a u8 corresponding to the flag states then PUSH
-    u8 FLAGS = (flagZ << 7) | (flagN << 6) | (flagH << 5) | (flagC << 4);
-    PUSH(A, FLAGS);
+    // F is only filled in when AF is used as a whole
+    F = getF();
+    PUSH(AF);
 }
 
-void CPU::POP(u8 &hi, u8 &lo) {
-    Utils::setPair(hi, lo, mmu->read16(SP));
+void CPU::POP(u16 &target) {
+    target = mmu->read16(SP);
     SP += 2;
 }
 
 void CPU::POPaf() {
-    // set A to the hi byte and flag states corresponding to the lo byte
-    A = mmu->read8(SP + 1);
-    u8 FLAGS = mmu->read8(SP);
-    setZNHC(FLAGS >> 7, (FLAGS >> 6) & 1, (FLAGS >> 5) & 1, (FLAGS >> 4) & 1);
-    SP += 2;
+    // the flags are worked out from the lo byte
+    POP(AF);
+    setF(F);
 }
 
 // logic instructions
 void CPU::AND(u8 val) {
     A &= val;
-    setZNHC(!A, false, true, false);
+    setZNHC(A, false, 0x10, 0);
 }
 
 void CPU::CCF() {
-    setNHC(false, false, !flagC);
+    setNHC(false, 0, flagCsrc ^ 0x100);
 }
 
 void CPU::CP(u8 val) {
-    u8 res = A - val;
-    setZNHC(!res, true, (A & 0xF) < (val & 0xF), res > A);
+    u16 res = A - val;
+    setZNHC(res, true, A ^ val ^ res, res);
 }
 
 void CPU::CPL() {
     A = ~A;
-    flagN = flagH = true;
+    flagN = true;
+    flagHsrc = 0x10;
 }
 
 void CPU::DAA() {
-    if (flagN) {
-        // adjust after subtraction
-        if (flagC || A > 0x99) {
+    if (!flagN) {
+        // adjust after addition, carrying out of either digit
+        if (getC() || A > 0x99) {
             A += 0x60;
-            flagC = true;
+            flagCsrc = 0x100;
         }
-        if (flagH || (A & 0xF) > 0x9) {
+        if (getH() || (A & 0xF) > 0x9) {
             A += 0x6;
         }
     } else {
-        // adjust after addition
-        if (flagC) {
-            A += 0x60;
+        // adjust after subtraction, which only borrows when the flags say so
+        if (getC()) {
+            A -= 0x60;
         }
-        if (flagH) {
+        if (getH()) {
             A -= 0x6;
         }
     }
-    flagZ = !A;
-    flagH = false;
+    flagZsrc = A;
+    flagHsrc = 0;
 }
 
 void CPU::OR(u8 val) {
     A |= val;
-    setZNHC(!A, false, false, false);
+    setZNHC(A, false, 0, 0);
 }
 
 void CPU::SCF() {
-    setNHC(false, false, true);
+    setNHC(false, 0, 0x100);
 }
 
 void CPU::XOR(u8 val) {
     A ^= val;
-    setZNHC(!A, false, false, false);
+    setZNHC(A, false, 0, 0);
 }
 
 // arithmetic instructions
 void CPU::ADC(u8 val) {
-    u8 add = val + flagC;
-    u8 res = A + add;
-    setZNHC(!res, false, (A & 0xF) + (add & 0xF) > 0xF, res < A);
+    // the carry is added in with the rest, so adding 0xFF plus a carry
+    // still carries out
+    u16 res = A + val + getC();
+    setZNHC(res, false, A ^ val ^ res, res);
     A = res;
 }
 
 void CPU::ADD(u8 val) {
-    u8 res = A + val;
-    setZNHC(!res, false, (A & 0xF) + (val & 0xF) > 0xF, res < A);
+    u16 res = A + val;
+    setZNHC(res, false, A ^ val ^ res, res);
     A = res;
 }
 
 void CPU::ADDhl(u16 val) {
-    u16 HL = Utils::getPair(H, L);
-    u16 res = HL + val;
-    setNHC(false, (HL & 0x0FFF) + (val & 0x0FFF) > 0x0FFF, res < HL);
-    Utils::setPair(H, L, res);
+    u32 res = HL + val;
+
+    // the carries out of bits 11 and 15 land where H and C look for them
+    setNHC(false, (HL ^ val ^ res) >> 8, res >> 8);
+    HL = res;
 }
 
 void CPU::ADDsp(s8 val) {
-    u16 res;
-    if (val < 0) {
-        res = SP - (u8)val;
-        setZNHC(false, false, (SP & 0xF) < ((u8)val & 0xF), res > SP);
-    } else {
-        res = SP + (u8)val;
-        setZNHC(false, false, (SP & 0xF) + ((u8)val & 0xF) > 0xF, res < SP);
-    }
-    SP = res;
+    SP = offsetSP(val);
+}
+
+u16 CPU::offsetSP(s8 val) {
+    // the flags come from adding the offset to the low byte as if it were
+    // unsigned, whichever way it actually moves SP
+    u8 offset = val;
+    u16 low = (SP & 0xFF) + offset;
+    setZNHC(1, false, SP ^ offset ^ low, low);
+    return SP + val;
 }
 
 void CPU::DEC(u8 &target) {
     u8 res = target - 1;
-    setZNH(!res, true, (target & 0xF) < 1);
+    setZNH(res, true, target ^ 1 ^ res);
     target = res;
 }
 
-void CPU::DECrr(u8 &hi, u8 &lo) {
-    u16 val = Utils::getPair(hi, lo);
-    Utils::setPair(hi, lo, val - 1);
-}
-
-void CPU::DECsp() {
-    SP -= 1;
+void CPU::DECrr(u16 &target) {
+    target--;
 }
 
 void CPU::INC(u8 &target) {
     u8 res = target + 1;
-    setZNH(!res, false, (target & 0xF) + 1 > 0xF);
+    setZNH(res, false, target ^ 1 ^ res);
     target = res;
 }
 
-void CPU::INCrr(u8 &hi, u8 &lo) {
-    u16 val = Utils::getPair(hi, lo);
-    Utils::setPair(hi, lo, val + 1);
-}
-
-void CPU::INCsp() {
-    SP += 1;
+void CPU::INCrr(u16 &target) {
+    target++;
 }
 
 void CPU::SBC(u8 val) {
-    u8 sub = val + flagC;
-    u8 res = A - sub;
-    setZNHC(!res, true, (A & 0xF) < (sub & 0xF), res > A);
+    // a borrow out of the top leaves bit 8 set, just as a carry would
+    u16 res = A - val - getC();
+    setZNHC(res, true, A ^ val ^ res, res);
     A = res;
 }
 
 void CPU::SUB(u8 val) {
-    u8 res = A - val;
-    setZNHC(!res, true, (A & 0xF) < (val & 0xF), res > A);
+    u16 res = A - val;
+    setZNHC(res, true, A ^ val ^ res, res);
     A = res;
 }
 
 // jump and return instructions
 void CPU::CALL(u16 addr) {
-    branched = true;
-    u16 next = mmu->read16(PC + 3);
-    PUSH(Utils::getHi(next), Utils::getLo(next));
+    // PC already points to the next op, which is where to return to
+    PUSH(PC);
     JP(addr);
 }
 
@@ -205,7 +191,6 @@ void CPU::CALLcond(u16 addr, bool cond) {
 }
 
 void CPU::JP(u16 addr) {
-    branched = true;
     PC = addr;
 }
 
@@ -217,7 +202,7 @@ void CPU::JPcond(u16 addr, bool cond) {
 }
 
 void CPU::JR(s8 val) {
-    branched = true;
+    // jumps are relative to the start of the next op
     PC += val;
 }
 
@@ -229,10 +214,7 @@ void CPU::JRcond(s8 val, bool cond) {
 }
 
 void CPU::RET() {
-    branched = true;
-    u8 hi, lo;
-    POP(hi, lo);
-    JP(Utils::getPair(hi, lo));
+    POP(PC);
 }
 
 void CPU::RETcond(bool cond) {
@@ -249,63 +231,51 @@ void CPU::RETI() {
 
 // bit rotating and shifting instructions
 void CPU::RL(u8 &target, bool circular) {
-    bool B7 = Utils::getBit(target, 7);
-    A <<= 1;
-    if (circular) {
-        Utils::setBit(target, 0, B7);
-    } else {
-        Utils::setBit(target, 0, flagC);
-    }
-    setZNHC(!target, false, false, B7);
+    // bit 7 is shifted out into bit 8, where C is taken from
+    u16 res = target << 1 | (circular ? target >> 7 : getC());
+    target = res;
+    setZNHC(target, false, 0, res);
 }
 
 void CPU::RLa(bool circular) {
     // call the standard RL op on A but reset flag Z
     RL(A, circular);
-    flagZ = false;
+    flagZsrc = 1;
 }
 
 void CPU::RR(u8 &target, bool circular) {
-    bool B7 = Utils::getBit(target, 7);
-    A >>= 1;
-    if (circular) {
-        Utils::setBit(target, 7, B7);
-    } else {
-        Utils::setBit(target, 7, flagC);
-    }
-    setZNHC(!target, false, false, B7);
+    u8 res = target >> 1 | (circular ? target : getC()) << 7;
+    setZNHC(res, false, 0, target << 8);
+    target = res;
 }
 
 void CPU::RRa(bool circular) {
     // call the standard RR op on register A but reset flag Z
     RR(A, circular);
-    flagZ = false;
+    flagZsrc = 1;
 }
 
 void CPU::SLA(u8 &target) {
-    u8 B7 = Utils::getBit(target, 7);
-    target <<= 1;
-    setZNHC(!target, false, false, B7);
+    u16 res = target << 1;
+    target = res;
+    setZNHC(target, false, 0, res);
 }
 
 void CPU::SRA(u8 &target) {
-    bool B0 = Utils::getBit(target, 0);
-    bool B7 = Utils::getBit(target, 7);
-    target >>= 1;
-    Utils::setBit(target, 7, B7);
-    setZNHC(!target, false, false, B0);
+    u8 res = target >> 1 | (target & 0x80);
+    setZNHC(res, false, 0, target << 8);
+    target = res;
 }
 
 void CPU::SRL(u8 &target) {
-    bool B0 = Utils::getBit(target, 0);
-    target >>= 1;
-    setZNHC(!target, false, false, B0);
+    u8 res = target >> 1;
+    setZNHC(res, false, 0, target << 8);
+    target = res;
 }
 
 // bit setting and clearing
 void CPU::BIT(int bit, u8 val) {
-    bool state = Utils::getBit(val, bit);
-    setZNH(!state, false, true);
+    setZNH(val & (1 << bit), false, 0x10);
 }
 
 void CPU::RES(int bit, u8 &target) {
@@ -319,7 +289,7 @@ void CPU::SET(int bit, u8 &target) {
 void CPU::SWAP(u8 &target) {
     u8 temp = target;
     target = ((temp & 0xF0) >> 4) | ((temp & 0x0F) << 4);
-    setZNHC(!target, false, false, false);
+    setZNHC(target, false, 0, 0);
 }
 
 // control instructions
@@ -332,7 +302,7 @@ void CPU::EI() {
 }
 
 void CPU::HALT() {
-    // gets reset to false whenever an interrupt occurs
+    // gets reset to false whenever an interrupt is requested
     halt = true;
 }
 
@@ -341,9 +311,7 @@ void CPU::NOP() {
 }
 
 void CPU::RST(u16 addr) {
-    branched = true;
-    u16 next = mmu->read16(PC + 1);
-    PUSH(Utils::getHi(next), Utils::getLo(next));
+    PUSH(PC);
     JP(addr);
 }
 
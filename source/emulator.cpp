@@ -1,107 +1,387 @@
 #include "emulator.hpp"
+#include <algorithm>
 
-Emulator::Emulator(char *romPath) {
-    mmu.loadROM(romPath);
+#ifndef HEADLESS
+#include <chrono>
+#include <thread>
+#endif
+
+Emulator::Emulator(const char *romPath) {
+    loaded = mmu.loadROM(romPath);
+    mmu.bindScheduler(&sched);
+    mmu.bindCPU(&cpu);
+    mmu.bindTimer(&timer);
+    mmu.bindPPU(&ppu);
+    mmu.bindAPU(&apu);
 
     cpu.reset();
     cpu.bindMMU(&mmu);
 
-    win.create(sf::VideoMode(160, 144), "gbpp");
+    timer.bindMMU(&mmu);
+    timer.bindScheduler(&sched);
+    timer.reset();
+
+    ppu.bindMMU(&mmu);
+    ppu.bindScheduler(&sched);
+    ppu.reset();
+
+    apu.bindMMU(&mmu);
+    apu.bindScheduler(&sched);
+    apu.reset();
+
+    history.bindMMU(&mmu);
+
+    #ifdef PROFILE
+    cpu.bindProfiler(&profiler);
+    #endif
 }
 
+#ifndef HEADLESS
 void Emulator::run() {
+    // the screen is drawn at 3x scale
+    win.create(sf::VideoMode(PPU::WIDTH * 3, PPU::HEIGHT * 3), "gbpp");
+    screen.create(PPU::WIDTH, PPU::HEIGHT);
+    sprite.setTexture(screen);
+    sprite.setScale(3, 3);
+
+    AudioStream audio(apu.getOutput(), APU::SAMPLE_RATE);
+    audio.play();
+
+    running = true;
+    std::thread emulation(&Emulator::emulate, this);
+
     while (win.isOpen()) {
-        // main game logic is updated at 60FPS
-        if (timer.getElapsedTime().asSeconds() >= 1.0 / 60) {
-            
-            // CPU executes 4194304 cycles per second == 69905 per frame
-            while (cycles < 69905) {
-                cyclesThisLoop = cpu.run();
+        handleEvents();
 
-                updateTimers(cyclesThisLoop);
-                handleInterrupts();
+        // only draw when there is a new frame, otherwise give the emulation
+        // thread the time
+        if (display.update()) {
+            draw();
+        } else {
+            sf::sleep(sf::milliseconds(1));
+        }
+    }
 
-                mmu.updateSpecialRegs();
+    running = false;
+    emulation.join();
+    audio.stop();
+}
 
-                cycles += cyclesThisLoop;
-            }
+Pacer &Emulator::getPacer() {
+    return pacer;
+}
 
-            cycles = 0;
-            timer.restart();
+void Emulator::setFastForward(bool enabled, double speed) {
+    fastForward = enabled;
+    fastSpeed = speed;
+}
+
+void Emulator::setFrameSkip(bool enabled) {
+    frameSkip = enabled;
+}
+
+void Emulator::emulate() {
+    using Clock = std::chrono::steady_clock;
+
+    // frames run at the real hardware's rate, sleeping in between
+    const u64 period = CYCLES_PER_FRAME * 1000000000ull / CLOCK_SPEED;
+    pacer.start(period);
+    bool wasFast = false;
+
+    // while fast forwarding, frames are only passed on to the window as
+    // often as real time ones would be
+    const Clock::duration showPeriod = std::chrono::nanoseconds(period);
+    Clock::time_point lastShown = Clock::now();
+    Clock::duration frameTime(0);
+
+    while (running) {
+        // the pace changes whenever fast forward is toggled
+        bool fast = fastForward;
+        bool paced = !fast || fastSpeed > 0;
+        if (fast != wasFast && paced) {
+            pacer.start(fast ? (u64)(period / fastSpeed) : period);
         }
+        wasFast = fast;
 
-        handleEvents();
+        if (paced) {
+            pacer.wait();
+        }
+
+        // input from the window thread is picked up between frames
+        u8 pressed = heldButtons;
+        if (pressed != buttons) {
+            setButtons(pressed);
+        }
+        if (rewindRequested.exchange(false)) {
+            rewind();
+        }
+
+        // show the frame if the next one would finish too late to be shown
+        // in its place
+        Clock::time_point start = Clock::now();
+        bool show = !fast || start - lastShown + frameTime >= showPeriod;
+        ppu.setRendering(show || !frameSkip);
+
+        runFrame();
+        frameTime = Clock::now() - start;
+
+        if (show) {
+            const u32 *frame = ppu.getFrame();
+            std::copy(frame, frame + PPU::WIDTH * PPU::HEIGHT,
+                      display.getBack().begin());
+            display.publish();
+            lastShown = start;
+        }
     }
 }
+#endif
 
-void Emulator::updateTimers(int cycles) {
-    divCounter += cycles;
-    // DIV is incremented at a rate of 16384 Hz = every 256th cycle
-    if (divCounter >= 256) {
-        u8 &DIV = mmu.getRef(MMU::DIV);
-        DIV++;
-        divCounter = 0;
-    }
-    // TIMA needs to be incremented by the rate defined in TAC and only if the
-    // enable bit is set
-    u8 &TAC = mmu.getRef(MMU::TAC);
-    if (Utils::getBit(TAC, 2)) {
-        tmaCounter += cycles;
-
-        bool B0 = Utils::getBit(TAC, 0);
-        bool B1 = Utils::getBit(TAC, 1);
-        bool incTIMA = false;
-        
-        if (!B1 && !B0) {
-            // increment every 1024 cycles
-            if (tmaCounter >= 1024) {
-                incTIMA = true;
-                tmaCounter = 0;
-            }    
-        } else if (!B1 && B0) {
-            // increment every 16 cycles
-            if (tmaCounter >= 16) {
-                incTIMA = true;
-                tmaCounter = 0;
-            }
-        } else if (B1 && !B0) {
-            // incrememnt every 64 cycles
-            if (tmaCounter >= 64) {
-                incTIMA = true;
-                tmaCounter = 0;
-            }
+void Emulator::runHeadless(u64 maxFrames, u64 maxCycles) {
+    while ((!maxFrames || frames < maxFrames) &&
+           (!maxCycles || sched.now < maxCycles)) {
+        // run whole frames while the cycle budget allows it
+        if (maxCycles && maxCycles < frameEnd) {
+            runUntil(maxCycles);
         } else {
-            // increment every 256 cycles
-            if (tmaCounter >= 256) {
-                incTIMA = true;
-                tmaCounter = 0;
-            }
+            runFrame();
         }
+    }
+}
+
+void Emulator::runFrame() {
+    runUntil(frameEnd);
+    apu.endFrame();
+    frameEnd += CYCLES_PER_FRAME;
+    frames++;
+
+    if (rewindInterval && frames % rewindInterval == 0) {
+        writeState(rewindState, false);
+        history.push(rewindState);
+    }
+}
+
+void Emulator::setIdleSkip(bool enabled) {
+    cpu.setIdleSkip(enabled);
+}
+
+void Emulator::setButtons(u8 pressed) {
+    buttons = pressed;
+    mmu.setJoypad(pressed);
+}
+
+bool Emulator::isLoaded() {
+    return loaded;
+}
+
+u64 Emulator::getFrames() {
+    return frames;
+}
+
+u64 Emulator::getTotalCycles() {
+    return sched.now;
+}
 
-        // TIMA imcremented, but if an overflow occurs it is set to the value
-        // of TMA and a TIMER interrupt is triggered
-        if (incTIMA) {
-            u8 &TIMA = mmu.getRef(MMU::TIMA); 
-            if (TIMA == 0xFF) {
-                // overflow is about to happen
-                u8 &TMA = mmu.getRef(MMU::TMA);
-                u8 &IF = mmu.getRef(MMU::IF);
-                Utils::setBit(IF, 2, true);
-                TIMA = TMA;
-            } else {
-                TIMA++;
+const u32 *Emulator::getFrame() {
+    return ppu.getFrame();
+}
+
+RingBuffer<s16> &Emulator::getAudio() {
+    return apu.getOutput();
+}
+
+void Emulator::setSerialOutput(std::vector<u8> *target) {
+    mmu.bindSerialOutput(target);
+}
+
+u8 Emulator::peek(u16 addr) {
+    return mmu.read8(addr);
+}
+
+u64 Emulator::getHash() {
+    u64 hash = 0xCBF29CE484222325;
+    for (u32 i = 0; i < mmu.getChunkCount(); i++) {
+        const u8 *chunk = mmu.getChunk(i);
+        for (u32 j = 0; j < MMU::CHUNK_SIZE; j++) {
+            hash = (hash ^ chunk[j]) * 0x100000001B3;
+        }
+    }
+
+    const u8 *pixels = (const u8 *)ppu.getFrame();
+    for (u32 i = 0; i < PPU::WIDTH * PPU::HEIGHT * 4; i++) {
+        hash = (hash ^ pixels[i]) * 0x100000001B3;
+    }
+    return hash;
+}
+
+void Emulator::saveState(std::vector<u8> &out) {
+    writeState(out, true);
+}
+
+bool Emulator::loadState(const std::vector<u8> &in) {
+    return readState(in, true);
+}
+
+void Emulator::enableRewind(size_t bytes, int interval) {
+    rewindInterval = interval;
+    history.setup(bytes);
+}
+
+bool Emulator::rewind() {
+    return history.pop(rewindState) && readState(rewindState, false);
+}
+
+#ifdef PROFILE
+Profiler &Emulator::getProfiler() {
+    return profiler;
+}
+#endif
+
+#ifdef TRACE
+void Emulator::enableTrace(size_t entries) {
+    trace.setup(entries);
+    cpu.bindTrace(&trace);
+}
+
+Trace &Emulator::getTrace() {
+    return trace;
+}
+#endif
+
+void Emulator::writeState(std::vector<u8> &out, bool withRAM) {
+    State::Writer writer(out);
+
+    // the header is filled in again once the size is known (and cleared
+    // first, so that its padding is always saved the same way)
+    State::Header header = {};
+    header.magic = State::MAGIC;
+    header.version = State::VERSION;
+    header.romChecksum = mmu.getROMChecksum();
+    header.withRAM = withRAM;
+    writer.write(header);
+
+    SavedState state = {frames, frameEnd};
+    writer.write(state);
+
+    cpu.saveState(writer);
+    mmu.saveState(writer, withRAM);
+    sched.saveState(writer);
+    timer.saveState(writer);
+    ppu.saveState(writer);
+    apu.saveState(writer);
+
+    header.size = writer.size();
+    memcpy(out.data(), &header, sizeof(header));
+    out.resize(writer.size());
+}
+
+bool Emulator::readState(const std::vector<u8> &in, bool withRAM) {
+    State::Reader reader(in.data(), in.size());
+
+    State::Header header;
+    if (!reader.read(header) ||
+        header.magic != State::MAGIC ||
+        header.version != State::VERSION ||
+        header.size != in.size() ||
+        header.romChecksum != mmu.getROMChecksum() ||
+        header.withRAM != withRAM) {
+        return false;
+    }
+
+    SavedState state;
+    if (!reader.read(state)) {
+        return false;
+    }
+    frames = state.frames;
+    frameEnd = state.frameEnd;
+
+    // the size was checked against the header, so these can't run short
+    return cpu.loadState(reader) &&
+           mmu.loadState(reader, withRAM) &&
+           sched.loadState(reader) &&
+           timer.loadState(reader) &&
+           ppu.loadState(reader) &&
+           apu.loadState(reader);
+}
+
+void Emulator::runUntil(u64 target) {
+    while (sched.now < target) {
+        // handle everything that has fallen due, which may have requested
+        // interrupts
+        u64 deadline = sched.nextDeadline();
+        if (sched.now >= deadline) {
+            Event ev;
+            u64 when;
+            while (sched.popDue(ev, when)) {
+                handleEvent(ev, when);
             }
+            handleInterrupts();
+            continue;
+        }
+
+        // a halted CPU can only be woken by an interrupt, and those are only
+        // requested by events, so skip straight to the next one
+        if (cpu.halt) {
+            #ifdef PROFILE
+            profiler.countHalt(std::min(deadline, target) - sched.now);
+            #endif
+            sched.now = std::min(deadline, target);
+            continue;
         }
+
+        // otherwise let the CPU run up to the next deadline - nothing else
+        // needs to be updated in between, apart from checking for interrupts
+        // the CPU raised itself between blocks
+        #ifdef TRACE
+        trace.setTime(sched.now);
+        #endif
+        sched.now += cpu.run(std::min(deadline, target) - sched.now);
+        handleInterrupts();
     }
+}
+
+void Emulator::handleEvent(Event ev, u64 when) {
+    switch (ev) {
+        case Event::TIMAOverflow:
+            timer.overflow(when);
+            break;
+
+        case Event::DMADone:
+            mmu.doDMATransfer();
+            break;
+
+        case Event::OAMScanDone:
+            ppu.endOAMScan(when);
+            break;
+
+        case Event::DrawDone:
+            ppu.endDrawing();
+            break;
 
+        case Event::LineDone:
+            ppu.endLine(when);
+            break;
+
+        case Event::SerialDone:
+            mmu.finishSerialTransfer();
+            break;
+
+        default:
+            break;
+    }
 }
 
 void Emulator::handleInterrupts() {
-    // check if there are no pending interrupts or if the master flag (IME)
-    // is set to false
+    // check if there are no pending interrupts
     u8 &IE = mmu.getRef(MMU::IE);
     u8 &IF = mmu.getRef(MMU::IF);
-    if (!IF || !cpu.IME) {
+    if (!(IF & IE & 0x1F)) {
+        return;
+    }
+
+    // any pending interrupt wakes a halted CPU, but is only serviced if the
+    // master flag (IME) is set
+    cpu.halt = false;
+    if (!cpu.IME) {
         return;
     }
 
@@ -136,14 +416,8 @@ void Emulator::handleInterrupts() {
     }
 }
 
+#ifndef HEADLESS
 void Emulator::handleEvents() {
-    // clear all key states first - note that true -> unpressed
-    u8 &JOYP = mmu.getRef(MMU::JOYP);
-    for (int i = 0; i < 4; i++) {
-        Utils::setBit(JOYP, i, true);
-    }
-
-    // now handle new events
     while (win.pollEvent(ev)) {
         // check for window 'X' clicks
         if (ev.type == sf::Event::Closed) {
@@ -158,50 +432,43 @@ void Emulator::handleEvents() {
                 win.close();
                 return;
             }
-            // update the joypad register, depending on bit 4 and 5 of JOYP
-            if (!Utils::getBit(JOYP, 5)) {
-                // update button key states (start, select, B, A)
-                switch (ev.key.code) {
-                    case sf::Keyboard::Q:   // GB START
-                        Utils::setBit(JOYP, 3, false);
-                        break;
-
-                    case sf::Keyboard::W:   // GB SELECT
-                        Utils::setBit(JOYP, 2, false);
-                        break;
-
-                    case sf::Keyboard::A:   // GB B
-                        Utils::setBit(JOYP, 1, false);
-                        break;
-
-                    case sf::Keyboard::S:   // GB A
-                        Utils::setBit(JOYP, 0, false);
-                        break;
-                }
-
-            } else if (!Utils::getBit(JOYP, 4)) {
-                // update d-pad key states (down, up, left, right)
-                switch (ev.key.code) {
-                    case sf::Keyboard::Down:
-                        Utils::setBit(JOYP, 3, false);
-                        break;
-
-                    case sf::Keyboard::Up:
-                        Utils::setBit(JOYP, 2, false);
-                        break;
-
-                    case sf::Keyboard::Left:
-                        Utils::setBit(JOYP, 1, false);
-                        break;
-
-                    case sf::Keyboard::Right:
-                        Utils::setBit(JOYP, 0, false);
-                        break;
-                }
+            // R steps back to the last rewind snapshot
+            if (ev.key.code == sf::Keyboard::R) {
+                rewindRequested = true;
+                continue;
+            }
+            // Tab toggles fast forward
+            if (ev.key.code == sf::Keyboard::Tab) {
+                fastForward = !fastForward;
+                continue;
             }
-            // since a keypress occured, request the JOYPAD interrupt
-            u8 &IF = mmu.getRef(MMU::IF);
-            Utils::setBit(IF, 4, true);
+        }
+
+        // keep track of which buttons are held, for the joypad register
+        bool pressed = ev.type == sf::Event::KeyPressed;
+        if (pressed || ev.type == sf::Event::KeyReleased) {
+            u8 button = 0;
+            switch (ev.key.code) {
+                case sf::Keyboard::Q: button = MMU::JOY_START; break;
+                case sf::Keyboard::W: button = MMU::JOY_SELECT; break;
+                case sf::Keyboard::A: button = MMU::JOY_B; break;
+                case sf::Keyboard::S: button = MMU::JOY_A; break;
+                case sf::Keyboard::Down: button = MMU::JOY_DOWN; break;
+                case sf::Keyboard::Up: button = MMU::JOY_UP; break;
+                case sf::Keyboard::Left: button = MMU::JOY_LEFT; break;
+                case sf::Keyboard::Right: button = MMU::JOY_RIGHT; break;
+                default: break;
+            }
+            keys = pressed ? keys | button : keys & ~button;
+            heldButtons = keys;
         }
     }
 }
+
+void Emulator::draw() {
+    screen.update((const sf::Uint8 *)display.getFront().data());
+    win.clear();
+    win.draw(sprite);
+    win.display();
+}
+#endif
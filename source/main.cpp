@@ -1,17 +1,198 @@
 #include "emulator.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <string>
 
 #include "utils.hpp"
 #include "types.hpp"
 
+void printUsage() {
+    std::cerr << "Usage: ./gbpp [--headless] [--frames N | --cycles N] "
+              << "[--rewind] [--speed N | --uncapped] [--no-frameskip] "
+              << "[--no-idle-skip] "
+              << "[--profile PREFIX] [--trace FILE [--trace-size N]] "
+              << "<ROM>\n";
+}
+
+// write the profile to PREFIX.txt and the call chains for a flame graph to
+// PREFIX.folded, and the trace to its file, for whichever were asked for
+bool writeOutputs(Emulator &gameboy, const char *profile, const char *trace) {
+    bool ok = true;
+
+    #ifdef PROFILE
+    if (profile) {
+        std::ofstream report(std::string(profile) + ".txt");
+        std::ofstream folded(std::string(profile) + ".folded");
+        gameboy.getProfiler().writeReport(report);
+        gameboy.getProfiler().writeFolded(folded);
+        if (!report.good() || !folded.good()) {
+            std::cerr << "Could not write profile: " << profile << "\n";
+            ok = false;
+        }
+    }
+    #endif
+
+    #ifdef TRACE
+    if (trace && !gameboy.getTrace().write(trace)) {
+        std::cerr << "Could not write trace: " << trace << "\n";
+        ok = false;
+    }
+    #endif
+
+    return ok;
+}
+
 int main(int argc, char **argv) {
-    if (argc < 2) {
-        std::cerr << "Usage: ./cppboy <ROM>\n";
+    char *romPath = nullptr;
+    bool headless = false;
+    bool rewind = false;
+    bool fastForward = false;
+    bool frameSkip = true;
+    bool idleSkip = true;
+    double speed = 0;
+    u64 maxFrames = 0;
+    u64 maxCycles = 0;
+    const char *profile = nullptr;
+    const char *trace = nullptr;
+    size_t traceSize = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--headless")) {
+            headless = true;
+        } else if (!strcmp(argv[i], "--rewind")) {
+            rewind = true;
+        } else if (!strcmp(argv[i], "--speed") && i + 1 < argc) {
+            // the whole argument has to be a number, or "abc" would quietly
+            // become 0 and run uncapped
+            char *end;
+            fastForward = true;
+            speed = strtod(argv[++i], &end);
+            if (end == argv[i] || *end || speed < 0) {
+                std::cerr << "Invalid speed: " << argv[i] << "\n";
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--uncapped")) {
+            fastForward = true;
+            speed = 0;
+        } else if (!strcmp(argv[i], "--no-frameskip")) {
+            frameSkip = false;
+        } else if (!strcmp(argv[i], "--no-idle-skip")) {
+            idleSkip = false;
+        } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            maxFrames = strtoull(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--cycles") && i + 1 < argc) {
+            maxCycles = strtoull(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+            profile = argv[++i];
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (!strcmp(argv[i], "--trace-size") && i + 1 < argc) {
+            traceSize = strtoull(argv[++i], nullptr, 10);
+        } else if (argv[i][0] != '-' && !romPath) {
+            romPath = argv[i];
+        } else {
+            printUsage();
+            return -1;
+        }
+    }
+
+    if (!romPath) {
+        printUsage();
+        return -1;
+    }
+
+    #ifndef PROFILE
+    if (profile) {
+        std::cerr << "Profiling isn't built in - rebuild with "
+                  << "'make PROFILE=1'\n";
+        return -1;
+    }
+    #endif
+
+    #ifndef TRACE
+    if (trace || traceSize) {
+        std::cerr << "Tracing isn't built in - rebuild with 'make TRACE=1'\n";
+        return -1;
+    }
+    #endif
+
+    #ifdef HEADLESS
+    // builds without SFML can only ever run headless
+    headless = true;
+    #endif
+
+    // running headless is always uncapped and never draws anything, so
+    // these would silently do nothing
+    if (headless && (fastForward || !frameSkip)) {
+        std::cerr << "--speed, --uncapped and --no-frameskip only apply when "
+                  << "running in a window\n";
+        return -1;
+    }
+
+    Emulator gameboy(romPath);
+    if (!gameboy.isLoaded()) {
         return -1;
     }
+    if (!idleSkip) {
+        gameboy.setIdleSkip(false);
+    }
+
+    // keep 16MB of history, with a snapshot every 5 frames
+    if (rewind) {
+        gameboy.enableRewind(16 << 20, 5);
+    }
+
+    #ifdef TRACE
+    // keep the last million ops (16MB) unless told otherwise
+    if (trace) {
+        gameboy.enableTrace(traceSize ? traceSize : 1 << 20);
+    }
+    #endif
+
+    if (!headless) {
+        #ifndef HEADLESS
+        // fast forward starts on if a speed was given (and otherwise runs
+        // uncapped when toggled on)
+        gameboy.setFastForward(fastForward, speed);
+        gameboy.setFrameSkip(frameSkip);
+        gameboy.run();
+
+        // report how late frames were compared to when they were due
+        Pacer &pacer = gameboy.getPacer();
+        std::cout << "frames:   " << pacer.getTicks() << "\n"
+                  << "late:     " << pacer.getLateTicks() << "\n"
+                  << "resyncs:  " << pacer.getResyncs() << "\n"
+                  << "error:    " << pacer.getMeanError() << "us mean, "
+                  << pacer.getJitter() << "us jitter, "
+                  << pacer.getMaxError() << "us max\n";
+        #endif
+
+        return writeOutputs(gameboy, profile, trace) ? 0 : -1;
+    }
+
+    // without a budget, emulate one minute of game time
+    if (!maxFrames && !maxCycles) {
+        maxFrames = 60 * 60;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    gameboy.runHeadless(maxFrames, maxCycles);
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    u64 frames = gameboy.getFrames();
+    u64 cycles = gameboy.getTotalCycles();
 
-    Emulator gameboy(argv[1]);
-    gameboy.run();
+    std::cout << "frames:   " << frames << "\n"
+              << "cycles:   " << cycles << "\n"
+              << "seconds:  " << seconds << "\n"
+              << "fps:      " << frames / seconds << "\n"
+              << "MHz:      " << cycles / seconds / 1e6 << "\n"
+              << "speed:    " << cycles / seconds / Emulator::CLOCK_SPEED
+              << "x\n";
 
-    return 0;
+    return writeOutputs(gameboy, profile, trace) ? 0 : -1;
 }
@@ -0,0 +1,224 @@
+#include "mmu.hpp"
+
+void MMU::setupMBC() {
+    // the cartridge type lives at 0x0147 in the header
+    switch (rom[0x0147]) {
+        case 0x00: case 0x08: case 0x09:
+            mbc = MBC_NONE;
+            break;
+
+        case 0x01: case 0x02: case 0x03:
+            mbc = MBC_1;
+            break;
+
+        case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+            mbc = MBC_3;
+            break;
+
+        case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+            mbc = MBC_5;
+            break;
+
+        default:
+            std::cerr << "Unsupported cartridge type: "
+                      << Utils::formatHex(rom[0x0147], 2) << "\n";
+            mbc = MBC_NONE;
+            break;
+    }
+    hasRTC = rom[0x0147] == 0x0F || rom[0x0147] == 0x10;
+
+    // and the size of cartridge RAM at 0x0149 - cartridges with only 2kB are
+    // given a whole 8kB bank to keep the page mapping simple
+    switch (rom[0x0149]) {
+        case 0x01: eramSize = 0x02000; break;
+        case 0x02: eramSize = 0x02000; break;
+        case 0x03: eramSize = 0x08000; break;
+        case 0x04: eramSize = 0x20000; break;
+        case 0x05: eramSize = 0x10000; break;
+        default: eramSize = 0; break;
+    }
+    ram.assign(ERAM_OFFSET + eramSize, 0);
+    dirty.assign(ram.size() / CHUNK_SIZE, 1);
+
+    // without an MBC there is nothing to enable cartridge RAM with, so it's
+    // always on (for the ROM+RAM types)
+    ramEnabled = mbc == MBC_NONE;
+    romBank = 1;
+    ramBank = 0;
+    mbc1Upper = 0;
+    mbc1Mode = false;
+}
+
+void MMU::writeMBC(u16 addr, u8 data) {
+    if (mbc == MBC_NONE) {
+        return;
+    }
+
+    // 0x0000 - 0x1FFF enables cartridge RAM (and the clock) on all MBCs
+    if (addr < 0x2000) {
+        ramEnabled = (data & 0x0F) == 0x0A;
+        mapERAM();
+        return;
+    }
+
+    switch (mbc) {
+        case MBC_1:
+            if (addr < 0x4000) {
+                // lower 5 bits of the ROM bank, where 0 is treated as 1
+                romBank = data & 0x1F;
+                if (!romBank) {
+                    romBank = 1;
+                }
+            } else if (addr < 0x6000) {
+                // upper 2 bits of the ROM bank, or the RAM bank in mode 1
+                mbc1Upper = data & 0x03;
+            } else {
+                mbc1Mode = data & 0x01;
+            }
+            break;
+
+        case MBC_3:
+            if (addr < 0x4000) {
+                romBank = data & 0x7F;
+                if (!romBank) {
+                    romBank = 1;
+                }
+            } else if (addr < 0x6000) {
+                // 0x00 - 0x03 select a RAM bank, 0x08 - 0x0C a clock register
+                ramBank = data;
+            } else {
+                // writing 0x00 then 0x01 latches the clock registers
+                if (rtcLatch == 0x00 && data == 0x01) {
+                    updateRTC();
+                    getRTCRegs(rtcLatched);
+                }
+                rtcLatch = data;
+            }
+            break;
+
+        case MBC_5:
+            if (addr < 0x3000) {
+                // lower 8 bits of the ROM bank - bank 0 can be mapped here
+                romBank = (romBank & 0x100) | data;
+            } else if (addr < 0x4000) {
+                romBank = (romBank & 0xFF) | ((data & 0x01) << 8);
+            } else if (addr < 0x6000) {
+                ramBank = data & 0x0F;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    mapROM();
+    mapERAM();
+}
+
+void MMU::mapROM() {
+    if (!rom) {
+        mapPages(0x00, 0x80, nullptr, nullptr);
+        return;
+    }
+
+    // in MBC1 mode 1, the upper bank bits also apply to the first bank
+    u16 oldLow = lowBank;
+    u16 oldHigh = highBank;
+    lowBank = 0;
+    if (mbc == MBC_1 && mbc1Mode) {
+        lowBank = mbc1Upper << 5;
+    }
+
+    switch (mbc) {
+        case MBC_1:
+            highBank = (mbc1Upper << 5) | romBank;
+            break;
+
+        case MBC_3:
+        case MBC_5:
+            highBank = romBank;
+            break;
+
+        default:
+            highBank = 1;
+            break;
+    }
+
+    // bank numbers past the end of the ROM wrap around
+    lowBank %= romBanks;
+    highBank %= romBanks;
+
+    // switching banks only needs the page table entries to be repointed
+    mapPages(0x00, 0x40, rom + lowBank * 0x4000, nullptr);
+    mapPages(0x40, 0x40, rom + highBank * 0x4000, nullptr);
+
+    // writes that only select a RAM bank or latch the clock also come
+    // through here, and shouldn't cut running code short
+    if (lowBank != oldLow || highBank != oldHigh) {
+        romMapVersion++;
+    }
+}
+
+void MMU::mapERAM() {
+    // disabled RAM and the MBC3 clock registers are handled by the slow path
+    bool isRTC = mbc == MBC_3 && ramBank >= 0x08;
+    if (!ramEnabled || !eramSize || isRTC) {
+        mapPages(0xA0, 0x20, nullptr, nullptr);
+        return;
+    }
+
+    u32 bank = mbc == MBC_1 ? (mbc1Mode ? mbc1Upper : 0) : ramBank;
+    bank &= (eramSize / 0x2000) - 1;
+    u8 *eram = &ram[ERAM_OFFSET + bank * 0x2000];
+    mapPages(0xA0, 0x20, eram, eram);
+}
+
+void MMU::updateRTC() {
+    // the clock runs off emulated time, so it stays in step with the game
+    // however fast the emulator runs
+    const u64 CYCLES_PER_SECOND = 4194304;
+    const u64 MAX_TIME = 512 * 86400;
+
+    u64 now = sched->now;
+    if (rtcHalted) {
+        rtcSync = now;
+        return;
+    }
+
+    u64 seconds = (now - rtcSync) / CYCLES_PER_SECOND;
+    rtcTime += seconds;
+    rtcSync += seconds * CYCLES_PER_SECOND;
+
+    // the day counter is 9 bits, with a carry bit set when it overflows
+    if (rtcTime >= MAX_TIME) {
+        rtcCarry = true;
+        rtcTime %= MAX_TIME;
+    }
+}
+
+void MMU::getRTCRegs(u8 regs[5]) {
+    u64 days = rtcTime / 86400;
+    regs[0] = rtcTime % 60;
+    regs[1] = (rtcTime / 60) % 60;
+    regs[2] = (rtcTime / 3600) % 24;
+    regs[3] = days & 0xFF;
+    regs[4] = ((days >> 8) & 0x01) | (rtcHalted << 6) | (rtcCarry << 7);
+}
+
+void MMU::setRTCReg(int reg, u8 data) {
+    updateRTC();
+
+    u8 regs[5];
+    getRTCRegs(regs);
+    regs[reg] = data;
+
+    // writing the seconds register also resets the sub-second count
+    if (reg == 0) {
+        rtcSync = sched->now;
+    }
+
+    u64 days = regs[3] | ((regs[4] & 0x01) << 8);
+    rtcTime = regs[0] + regs[1] * 60 + regs[2] * 3600 + days * 86400;
+    rtcHalted = Utils::getBit(regs[4], 6);
+    rtcCarry = Utils::getBit(regs[4], 7);
+}
@@ -1,56 +1,429 @@
 #include "mmu.hpp"
+#include "apu.hpp"
+#include "cpu.hpp"
+#include "ppu.hpp"
+#include "timer.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
 
-void MMU::write8(u16 addr, u8 data) {
-    memory[addr] = data;
-
-    // any write to the DIV timing register causes it to be reset
-    if (addr == DIV) {
-        memory[DIV] = 0;
-    }
+MMU::MMU() {
+    // without a cartridge, the address space is just the internal RAM
+    ram.resize(ERAM_OFFSET, 0);
+    dirty.assign(ram.size() / CHUNK_SIZE, 1);
+    mapMemory();
+    updateJOYP();
 }
 
-void MMU::write16(u16 addr, u16 data) {
-    memory[addr] = data & 0x00FF;
-    memory[addr + 1] = (data & 0xFF00) >> 8;
+MMU::~MMU() {
+    unloadROM();
 }
 
-u8 MMU::read8(u16 addr) {
-    return memory[addr];
+void MMU::write16(u16 addr, u16 data) {
+    write8(addr, data & 0x00FF);
+    write8(addr + 1, (data & 0xFF00) >> 8);
 }
 
 u16 MMU::read16(u16 addr) {
-    return (memory[addr + 1] << 8) | memory[addr];
+    return (read8(addr + 1) << 8) | read8(addr);
 }
 
 u8 &MMU::getRef(u16 addr) {
-    return memory[addr];
+    // the reference may well be written through, so assume it is
+    u32 offset = HIGH_OFFSET + (addr - 0xFE00);
+    dirty[offset / CHUNK_SIZE] = 1;
+    return ram[offset];
+}
+
+const u8 *MMU::getVRAM() {
+    return &ram[VRAM_OFFSET];
+}
+
+const u8 *MMU::getOAM() {
+    return &ram[HIGH_OFFSET];
+}
+
+void MMU::writeSlow(u16 addr, u8 data) {
+    if (addr < 0x8000) {
+        // ROM is read only, but writes to it control the MBC
+        writeMBC(addr, data);
+    } else if (addr >= 0xA000 && addr < 0xC000) {
+        // cartridge RAM is either disabled, missing, or the MBC3 clock
+        if (ramEnabled && hasRTC && ramBank >= 0x08 && ramBank <= 0x0C) {
+            setRTCReg(ramBank - 0x08, data);
+        }
+    } else if (addr >= 0x8000 && addr < 0x9800) {
+        u32 offset = VRAM_OFFSET + (addr - 0x8000);
+        ram[offset] = data;
+        dirty[offset / CHUNK_SIZE] = 1;
+        ppu->invalidateTile(addr);
+    } else if (addr >= 0xFF00) {
+        writeIO(addr, data);
+    }
+}
+
+u8 MMU::readSlow(u16 addr) {
+    if (addr >= 0xFF00) {
+        return readIO(addr);
+    }
+
+    if (addr >= 0xA000 && addr < 0xC000) {
+        if (ramEnabled && hasRTC && ramBank >= 0x08 && ramBank <= 0x0C) {
+            return rtcLatched[ramBank - 0x08];
+        }
+    }
+
+    // anything unmapped reads as all ones
+    return 0xFF;
+}
+
+u8 MMU::readIO(u16 addr) {
+    if (addr == DIV || addr == TIMA) {
+        liveReads++;
+        return timer->read(addr);
+    }
+
+    // the APU is only run when something needs it to be, which includes
+    // reading its registers
+    if (addr >= APU::FIRST_REG && addr <= APU::LAST_REG) {
+        liveReads++;
+        return apu->read(addr);
+    }
+    return ram[HIGH_OFFSET + (addr - 0xFE00)];
+}
+
+void MMU::writeIO(u16 addr, u8 data) {
+    // the APU has to catch up before any of its registers change, so it
+    // takes care of writing them itself
+    if (addr >= APU::FIRST_REG && addr <= APU::LAST_REG) {
+        apu->write(addr, data);
+        return;
+    }
+
+    u8 old = getRef(addr);
+    getRef(addr) = data;
+
+    switch (addr) {
+        case LCDC:
+            ppu->updateLCDC();
+            break;
+
+        // the mode and coincidence bits of STAT are read only, and LY can't
+        // be written at all
+        case STAT:
+            getRef(STAT) = 0x80 | (data & 0x78) | (old & 0x07);
+            ppu->updateSTAT();
+            break;
+
+        case LY:
+            getRef(LY) = old;
+            break;
+
+        case LYC:
+            ppu->updateSTAT();
+            break;
+
+        // only the line select bits of JOYP can be written
+        case JOYP:
+            updateJOYP();
+            break;
+
+        // any write to the DIV timing register causes it to be reset
+        case DIV:
+            timer->writeDIV();
+            break;
+
+        case TIMA:
+            timer->writeTIMA();
+            break;
+
+        case TMA:
+            timer->writeTMA(old);
+            break;
+
+        case TAC:
+            timer->writeTAC(old);
+            break;
+
+        // a DMA transfer takes 160 machine cycles, during which the CPU can't
+        // read OAM - so it is only carried out once it has finished
+        case DMA:
+            sched->schedule(Event::DMADone, getTime() + 640);
+            break;
+
+        // setting bits 7 and 0 of SC starts a transfer using the internal
+        // clock, which shifts a bit out every 512 cycles
+        case SC:
+            if ((data & 0x81) == 0x81) {
+                sched->schedule(Event::SerialDone, getTime() + 8 * 512);
+            }
+            break;
+    }
 }
 
-void MMU::loadROM(std::string path) {
-    std::ifstream ROM(path, std::ios::binary);
-    ROM.read((char *)memory, 0x8000);
-    ROM.close();
+bool MMU::loadROM(std::string path) {
+    unloadROM();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+        std::cerr << "Could not open ROM: " << path << "\n";
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t size = info.st_size;
+
+    // map whole banks straight from the file - the mapping is private and
+    // read only, so pages are only faulted in when they are first read
+    if (size >= 0x8000 && size % 0x4000 == 0) {
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            rom = (const u8 *)mapped;
+            romSize = size;
+            romMapped = true;
+        }
+    }
+
+    // otherwise read it in, padded out to at least two whole banks
+    if (!romMapped) {
+        size_t padded = std::max<size_t>((size + 0x3FFF) & ~0x3FFF, 0x8000);
+        romCopy.assign(padded, 0xFF);
+
+        size_t done = 0;
+        while (done < size) {
+            ssize_t got = read(fd, romCopy.data() + done, size - done);
+            if (got <= 0) {
+                break;
+            }
+            done += got;
+        }
+        if (done < size) {
+            std::cerr << "Could not read ROM: " << path << "\n";
+            romCopy.clear();
+            close(fd);
+            return false;
+        }
+        rom = romCopy.data();
+        romSize = padded;
+    }
+    close(fd);
+
+    romBanks = romSize / 0x4000;
+    setupMBC();
+    mapMemory();
+    return true;
 }
 
-void MMU::updateSpecialRegs() {
-    // DIV is reset to 0 if anything is written to it
-    u8 div = read8(DIV);
-    if (oldDIV != div) {
-        div == 0;
+void MMU::loadROM(const u8 *data, size_t size) {
+    unloadROM();
+
+    size_t padded = std::max<size_t>((size + 0x3FFF) & ~0x3FFF, 0x8000);
+    romCopy.assign(padded, 0xFF);
+    std::copy(data, data + size, romCopy.begin());
+    rom = romCopy.data();
+    romSize = padded;
+
+    romBanks = romSize / 0x4000;
+    setupMBC();
+    mapMemory();
+}
+
+void MMU::unloadROM() {
+    if (romMapped) {
+        munmap((void *)rom, romSize);
     }
-    oldDIV = div;
+    rom = nullptr;
+    romSize = 0;
+    romMapped = false;
+    romCopy.clear();
+    romBanks = 0;
+}
 
-    // if DMA changed then a DMA transfer needs to happen
-    u8 dma = read8(DMA);
-    if (dma != oldDMA) {
-        doDMATransfer();
+void MMU::mapPages(int first, int count, const u8 *readBase, u8 *writeBase) {
+    for (int i = 0; i < count; i++) {
+        readPage[first + i] = readBase ? readBase + i * 0x100 : nullptr;
+        writePage[first + i] = writeBase ? writeBase + i * 0x100 : nullptr;
+
+        // writable pages always point into RAM
+        if (writeBase) {
+            writeChunk[first + i] = (writeBase - ram.data()) / CHUNK_SIZE + i;
+        }
     }
-    oldDMA = dma;
+}
+
+void MMU::mapMemory() {
+    u8 *vram = &ram[VRAM_OFFSET];
+    u8 *wram = &ram[WRAM_OFFSET];
+    u8 *high = &ram[HIGH_OFFSET];
+
+    mapPages(0x80, 0x18, vram, nullptr);
+    mapPages(0x98, 0x08, vram + 0x1800, vram + 0x1800);
+    mapPages(0xC0, 0x20, wram, wram);
+
+    // 0xE000 - 0xFDFF echoes 0xC000 - 0xDDFF
+    mapPages(0xE0, 0x1E, wram, wram);
+
+    // OAM is plain memory, but writes to I/O registers often need handling,
+    // and DIV and TIMA have to be worked out when they're read
+    mapPages(0xFE, 0x01, high, high);
+    mapPages(0xFF, 0x01, nullptr, nullptr);
+
+    mapROM();
+    mapERAM();
+}
+
+u16 MMU::getROMBank(u16 addr) {
+    return addr < 0x4000 ? lowBank : highBank;
+}
+
+u16 MMU::getROMChecksum() {
+    if (!rom) {
+        return 0;
+    }
+    return (rom[0x014E] << 8) | rom[0x014F];
+}
+
+void MMU::saveState(State::Writer &out, bool withRAM) {
+    // cleared first so that padding is always saved the same way
+    SavedState state = {};
+    state.ramSize = ram.size();
+    state.ramEnabled = ramEnabled;
+    state.romBank = romBank;
+    state.ramBank = ramBank;
+    state.mbc1Upper = mbc1Upper;
+    state.mbc1Mode = mbc1Mode;
+    state.rtcTime = rtcTime;
+    state.rtcSync = rtcSync;
+    state.rtcHalted = rtcHalted;
+    state.rtcCarry = rtcCarry;
+    state.rtcLatch = rtcLatch;
+    memcpy(state.rtcLatched, rtcLatched, sizeof(rtcLatched));
+    out.write(state);
+    if (withRAM) {
+        out.write(ram.data(), ram.size());
+    }
+}
+
+bool MMU::loadState(State::Reader &in, bool withRAM) {
+    SavedState state;
+    if (!in.read(state) || state.ramSize != ram.size()) {
+        return false;
+    }
+    if (withRAM) {
+        if (!in.read(ram.data(), ram.size())) {
+            return false;
+        }
+        dirty.assign(dirty.size(), 1);
+    }
+
+    ramEnabled = state.ramEnabled;
+    romBank = state.romBank;
+    ramBank = state.ramBank;
+    mbc1Upper = state.mbc1Upper;
+    mbc1Mode = state.mbc1Mode;
+    rtcTime = state.rtcTime;
+    rtcSync = state.rtcSync;
+    rtcHalted = state.rtcHalted;
+    rtcCarry = state.rtcCarry;
+    rtcLatch = state.rtcLatch;
+    memcpy(rtcLatched, state.rtcLatched, sizeof(rtcLatched));
+
+    // the restored banks need mapping back in
+    mapROM();
+    mapERAM();
+    return true;
+}
+
+u32 MMU::getChunkCount() {
+    return dirty.size();
+}
+
+u8 *MMU::getChunk(u32 chunk) {
+    return &ram[chunk * CHUNK_SIZE];
+}
+
+const u8 *MMU::getDirtyChunks() {
+    return dirty.data();
+}
+
+void MMU::markChunkDirty(u32 chunk) {
+    dirty[chunk] = 1;
+}
+
+void MMU::clearDirtyChunks() {
+    dirty.assign(dirty.size(), 0);
+}
+
+void MMU::bindScheduler(Scheduler *target) {
+    sched = target;
+}
+
+void MMU::bindCPU(CPU *target) {
+    cpu = target;
+}
+
+u64 MMU::getTime() {
+    return sched->now + (cpu ? cpu->getRunCycles() : 0);
+}
+
+void MMU::bindTimer(Timer *target) {
+    timer = target;
+}
+
+void MMU::bindPPU(PPU *target) {
+    ppu = target;
+}
+
+void MMU::bindAPU(APU *target) {
+    apu = target;
+}
+
+void MMU::bindSerialOutput(std::vector<u8> *target) {
+    serialOutput = target;
+}
+
+void MMU::setJoypad(u8 pressed) {
+    u8 before = getRef(JOYP);
+    joypad = pressed;
+    updateJOYP();
+
+    // the interrupt is requested when an input line goes from high to low
+    if (before & ~getRef(JOYP) & 0x0F) {
+        Utils::setBit(getRef(IF), 4, true);
+    }
+}
+
+void MMU::updateJOYP() {
+    // bit 4 low selects the d-pad, bit 5 low selects the buttons, and the
+    // low nibble reads 0 for any held key on a selected line
+    u8 &reg = getRef(JOYP);
+    u8 lines = 0x0F;
+    if (!Utils::getBit(reg, 4)) {
+        lines &= ~(joypad & 0x0F);
+    }
+    if (!Utils::getBit(reg, 5)) {
+        lines &= ~(joypad >> 4);
+    }
+    reg = 0xC0 | (reg & 0x30) | lines;
 }
 
 void MMU::doDMATransfer() {
-    u16 source = read8(DMA) * 100;
+    // DMA copies 160 bytes from 0xXX00 to OAM, where XX is the value in DMA
+    u16 source = read8(DMA) << 8;
     for (int i = 0; i < 160; i++) {
         write8(0xFE00 + i, read8(source + i));
     }
 }
+
+void MMU::finishSerialTransfer() {
+    if (serialOutput) {
+        serialOutput->push_back(getRef(SB));
+    }
+    getRef(SB) = 0xFF;
+    Utils::setBit(getRef(SC), 7, false);
+    Utils::setBit(getRef(IF), 3, true);
+}
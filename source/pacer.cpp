@@ -0,0 +1,85 @@
+#include "pacer.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+
+static const s64 NS_PER_SEC = 1000000000;
+
+static s64 toNanoseconds(const timespec &time) {
+    return time.tv_sec * NS_PER_SEC + time.tv_nsec;
+}
+
+static timespec fromNanoseconds(s64 ns) {
+    timespec time;
+    time.tv_sec = ns / NS_PER_SEC;
+    time.tv_nsec = ns % NS_PER_SEC;
+    return time;
+}
+
+static s64 getNow() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return toNanoseconds(now);
+}
+
+void Pacer::start(u64 period) {
+    this->period = period;
+    next = fromNanoseconds(getNow() + period);
+}
+
+void Pacer::wait() {
+    // sleeping until an absolute time can't drift, and carries on where it
+    // left off if a signal interrupts it
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr)
+           == EINTR) {
+    }
+
+    s64 deadline = toNanoseconds(next);
+    s64 now = getNow();
+    double error = (now - deadline) / 1000.0;
+
+    ticks++;
+    errorSum += error;
+    errorSquares += error * error;
+    maxError = std::max(maxError, error);
+
+    if (now - deadline > (s64)period) {
+        lateTicks++;
+    }
+
+    if (now - deadline > MAX_BEHIND * (s64)period) {
+        resyncs++;
+        next = fromNanoseconds(now + period);
+    } else {
+        next = fromNanoseconds(deadline + period);
+    }
+}
+
+u64 Pacer::getTicks() {
+    return ticks;
+}
+
+double Pacer::getMeanError() {
+    return ticks ? errorSum / ticks : 0;
+}
+
+double Pacer::getJitter() {
+    // standard deviation of the error
+    if (!ticks) {
+        return 0;
+    }
+    double mean = getMeanError();
+    return std::sqrt(std::max(0.0, errorSquares / ticks - mean * mean));
+}
+
+double Pacer::getMaxError() {
+    return maxError;
+}
+
+u64 Pacer::getLateTicks() {
+    return lateTicks;
+}
+
+u64 Pacer::getResyncs() {
+    return resyncs;
+}
@@ -0,0 +1,203 @@
+#include "pixels.hpp"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXELS_X86
+#include <immintrin.h>
+#endif
+
+namespace Pixels {
+
+static void decodeTileScalar(const u8 *data, u8 *out) {
+    // each row is two bytes - the low bits of all eight pixels and then the
+    // high bits, with the leftmost pixel in bit 7
+    for (int row = 0; row < 8; row++) {
+        u8 low = data[row * 2];
+        u8 high = data[row * 2 + 1];
+        for (int x = 0; x < 8; x++) {
+            int bit = 7 - x;
+            out[row * 8 + x] = (((high >> bit) & 1) << 1) | ((low >> bit) & 1);
+        }
+    }
+}
+
+static void mapPaletteScalar(const u8 *indices, const u32 *palette, u32 *out,
+                             int count) {
+    for (int i = 0; i < count; i++) {
+        out[i] = palette[indices[i]];
+    }
+}
+
+#ifdef PIXELS_X86
+// two rows at a time - every plane byte is copied into the eight bytes of
+// its row, masked with the bit for each pixel and compared to turn it into
+// 0 or 0xFF, which then just needs cutting down to bit 0 or bit 1
+static void decodeTileSSE2(const u8 *data, u8 *out) {
+    const __m128i bits = _mm_set_epi8(
+        1, 2, 4, 8, 16, 32, 64, (char)128,
+        1, 2, 4, 8, 16, 32, 64, (char)128);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi8(2);
+
+    __m128i tile = _mm_loadu_si128((const __m128i *)data);
+    for (int rows = 0; rows < 4; rows++) {
+        // spread bytes 0 - 3 (low, high, low, high) out to 8 bytes each
+        __m128i pairs = _mm_unpacklo_epi8(tile, tile);
+        __m128i quads = _mm_unpacklo_epi16(pairs, pairs);
+        __m128i low = _mm_shuffle_epi32(quads, 0xA0);
+        __m128i high = _mm_shuffle_epi32(quads, 0xF5);
+
+        __m128i lowSet = _mm_cmpeq_epi8(_mm_and_si128(low, bits), bits);
+        __m128i highSet = _mm_cmpeq_epi8(_mm_and_si128(high, bits), bits);
+        __m128i indices = _mm_or_si128(_mm_and_si128(lowSet, one),
+                                       _mm_and_si128(highSet, two));
+        _mm_storeu_si128((__m128i *)(out + rows * 16), indices);
+
+        tile = _mm_srli_si128(tile, 4);
+    }
+}
+
+// sixteen pixels at a time - SSE2 has no variable shuffle, so each pixel is
+// picked out of the palette by a pair of selects on the bits of its index
+static inline __m128i select(__m128i mask, __m128i set, __m128i clear) {
+    return _mm_or_si128(_mm_and_si128(mask, set),
+                        _mm_andnot_si128(mask, clear));
+}
+
+static void mapPaletteSSE2(const u8 *indices, const u32 *palette, u32 *out,
+                           int count) {
+    const __m128i colour0 = _mm_set1_epi32(palette[0]);
+    const __m128i colour1 = _mm_set1_epi32(palette[1]);
+    const __m128i colour2 = _mm_set1_epi32(palette[2]);
+    const __m128i colour3 = _mm_set1_epi32(palette[3]);
+    const __m128i zero = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        // shift each index's bits up to the top of the byte, where they can
+        // be spread across all 32 bits of its pixel by unpacking
+        __m128i index = _mm_loadu_si128((const __m128i *)(indices + i));
+        __m128i bit0 = _mm_cmpgt_epi8(zero, _mm_slli_epi16(index, 7));
+        __m128i bit1 = _mm_cmpgt_epi8(zero, _mm_slli_epi16(index, 6));
+
+        for (int part = 0; part < 4; part++) {
+            __m128i low0 = _mm_unpacklo_epi8(bit0, bit0);
+            __m128i low1 = _mm_unpacklo_epi8(bit1, bit1);
+            __m128i mask0 = _mm_unpacklo_epi16(low0, low0);
+            __m128i mask1 = _mm_unpacklo_epi16(low1, low1);
+
+            __m128i pixels = select(mask1,
+                                    select(mask0, colour3, colour2),
+                                    select(mask0, colour1, colour0));
+            _mm_storeu_si128((__m128i *)(out + i + part * 4), pixels);
+
+            bit0 = _mm_srli_si128(bit0, 4);
+            bit1 = _mm_srli_si128(bit1, 4);
+        }
+    }
+    mapPaletteScalar(indices + i, palette, out + i, count - i);
+}
+
+// four rows at a time - a byte shuffle copies each plane byte into the
+// eight bytes of its row in one go
+__attribute__((target("avx2")))
+static void decodeTileAVX2(const u8 *data, u8 *out) {
+    const __m256i bits = _mm256_set1_epi64x(0x0102040810204080);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi8(2);
+
+    // shuffles only work within each 128 bit half, so rows 0 - 1 come from
+    // the low half and rows 2 - 3 from the high half
+    const __m256i lowBytes = _mm256_setr_epi8(
+        0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 2, 2, 2, 2,
+        4, 4, 4, 4, 4, 4, 4, 4, 6, 6, 6, 6, 6, 6, 6, 6);
+    const __m256i highBytes = _mm256_add_epi8(lowBytes, one);
+    const __m256i nextRows = _mm256_set1_epi8(8);
+
+    __m256i tile = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)data));
+    for (int half = 0; half < 2; half++) {
+        __m256i offset = half ? nextRows : _mm256_setzero_si256();
+        __m256i low = _mm256_shuffle_epi8(
+            tile, _mm256_add_epi8(lowBytes, offset));
+        __m256i high = _mm256_shuffle_epi8(
+            tile, _mm256_add_epi8(highBytes, offset));
+
+        __m256i lowSet = _mm256_cmpeq_epi8(_mm256_and_si256(low, bits), bits);
+        __m256i highSet = _mm256_cmpeq_epi8(_mm256_and_si256(high, bits),
+                                            bits);
+        __m256i indices = _mm256_or_si256(_mm256_and_si256(lowSet, one),
+                                          _mm256_and_si256(highSet, two));
+        _mm256_storeu_si256((__m256i *)(out + half * 32), indices);
+    }
+}
+
+// eight pixels at a time, using the indices to permute the palette
+__attribute__((target("avx2")))
+static void mapPaletteAVX2(const u8 *indices, const u32 *palette, u32 *out,
+                           int count) {
+    const __m256i colours = _mm256_setr_epi32(
+        palette[0], palette[1], palette[2], palette[3],
+        palette[0], palette[1], palette[2], palette[3]);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i packed = _mm_loadl_epi64((const __m128i *)(indices + i));
+        __m256i index = _mm256_cvtepu8_epi32(packed);
+        __m256i pixels = _mm256_permutevar8x32_epi32(colours, index);
+        _mm256_storeu_si256((__m256i *)(out + i), pixels);
+    }
+    mapPaletteScalar(indices + i, palette, out + i, count - i);
+}
+#endif
+
+static const Kernels SCALAR = {"scalar", decodeTileScalar, mapPaletteScalar};
+#ifdef PIXELS_X86
+static const Kernels SSE2 = {"sse2", decodeTileSSE2, mapPaletteSSE2};
+static const Kernels AVX2 = {"avx2", decodeTileAVX2, mapPaletteAVX2};
+#endif
+
+static const Kernels *detect() {
+    #ifdef PIXELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return &SSE2;
+    }
+    #endif
+    return &SCALAR;
+}
+
+static const Kernels *current = detect();
+
+const Kernels &get() {
+    return *current;
+}
+
+bool use(const char *name) {
+    const Kernels *options[] = {
+        &SCALAR,
+        #ifdef PIXELS_X86
+        &SSE2, &AVX2
+        #endif
+    };
+
+    for (const Kernels *option : options) {
+        if (!strcmp(option->name, name)) {
+            #ifdef PIXELS_X86
+            __builtin_cpu_init();
+            if ((option == &AVX2 && !__builtin_cpu_supports("avx2")) ||
+                (option == &SSE2 && !__builtin_cpu_supports("sse2"))) {
+                return false;
+            }
+            #endif
+            current = option;
+            return true;
+        }
+    }
+    return false;
+}
+
+}
@@ -0,0 +1,300 @@
+#include "ppu.hpp"
+#include "pixels.hpp"
+#include <algorithm>
+
+// the four shades of the screen, from lightest to darkest
+static const u32 SHADES[4] = {
+    rgba(0xFF, 0xFF, 0xFF),
+    rgba(0xAA, 0xAA, 0xAA),
+    rgba(0x55, 0x55, 0x55),
+    rgba(0x00, 0x00, 0x00)
+};
+
+void PPU::bindMMU(MMU *target) {
+    mmu = target;
+}
+
+void PPU::bindScheduler(Scheduler *target) {
+    sched = target;
+}
+
+void PPU::reset() {
+    mmu->getRef(MMU::LCDC) = 0x91;
+    mmu->getRef(MMU::STAT) = 0x80;
+    mmu->getRef(MMU::LY) = 0;
+    mmu->getRef(MMU::BGP) = 0xFC;
+    mmu->getRef(MMU::OBP0) = 0xFF;
+    mmu->getRef(MMU::OBP1) = 0xFF;
+
+    invalidateTiles();
+    windowLine = 0;
+    statLine = false;
+
+    startLine(sched->now);
+}
+
+void PPU::startLine(u64 when) {
+    u8 LY = mmu->read8(MMU::LY);
+
+    if (LY < HEIGHT) {
+        if (LY == 0) {
+            windowLine = 0;
+        }
+        setMode(2);
+        sched->schedule(Event::OAMScanDone, when + OAM_CYCLES);
+    } else if (LY == HEIGHT) {
+        // entering line 144 starts VBLANK, so request the VBLANK interrupt
+        setMode(1);
+        Utils::setBit(mmu->getRef(MMU::IF), 0, true);
+    }
+
+    sched->schedule(Event::LineDone, when + CYCLES_PER_LINE);
+    checkSTAT();
+}
+
+void PPU::endOAMScan(u64 when) {
+    setMode(3);
+    checkSTAT();
+    sched->schedule(Event::DrawDone, when + DRAW_CYCLES);
+}
+
+void PPU::endDrawing() {
+    if (rendering) {
+        renderLine(mmu->read8(MMU::LY));
+    }
+    setMode(0);
+    checkSTAT();
+}
+
+void PPU::endLine(u64 when) {
+    u8 &LY = mmu->getRef(MMU::LY);
+    LY = (LY + 1) % LINES;
+    startLine(when);
+}
+
+void PPU::updateLCDC() {
+    // the line events are only ever pending while the LCD is on
+    bool enabled = Utils::getBit(mmu->read8(MMU::LCDC), 7);
+    bool running = sched->isPending(Event::LineDone);
+
+    if (enabled && !running) {
+        // turning the LCD on starts again from the top of the screen, from
+        // the cycle of the write rather than the start of the CPU's block
+        startLine(mmu->getTime());
+    } else if (!enabled && running) {
+        disable();
+    }
+}
+
+void PPU::updateSTAT() {
+    checkSTAT();
+}
+
+void PPU::invalidateTiles() {
+    std::fill(tileDirty, tileDirty + 384, true);
+}
+
+const u32 *PPU::getFrame() {
+    return frame;
+}
+
+void PPU::setRendering(bool enabled) {
+    rendering = enabled;
+}
+
+void PPU::saveState(State::Writer &out) {
+    SavedState state = {windowLine, statLine};
+    out.write(state);
+}
+
+bool PPU::loadState(State::Reader &in) {
+    SavedState state;
+    if (!in.read(state)) {
+        return false;
+    }
+    windowLine = state.windowLine;
+    statLine = state.statLine;
+
+    // VRAM has been replaced underneath the decoded tiles
+    invalidateTiles();
+    return true;
+}
+
+const u8 *PPU::getTileRow(int tile, int row) {
+    if (tileDirty[tile]) {
+        decodeTile(tile);
+    }
+    return tiles[tile][row];
+}
+
+void PPU::decodeTile(int tile) {
+    Pixels::get().decodeTile(mmu->getVRAM() + tile * 16, tiles[tile][0]);
+    tileDirty[tile] = false;
+}
+
+void PPU::setMode(int mode) {
+    u8 &STAT = mmu->getRef(MMU::STAT);
+    STAT = (STAT & ~0x03) | mode;
+}
+
+void PPU::checkSTAT() {
+    u8 &STAT = mmu->getRef(MMU::STAT);
+    bool coincidence = mmu->read8(MMU::LY) == mmu->read8(MMU::LYC);
+    Utils::setBit(STAT, 2, coincidence);
+
+    // bits 3 - 5 enable the interrupt for modes 0 - 2, and bit 6 enables it
+    // for LY == LYC
+    int mode = STAT & 0x03;
+    bool line = (coincidence && Utils::getBit(STAT, 6)) ||
+                (mode < 3 && Utils::getBit(STAT, 3 + mode));
+
+    if (line && !statLine) {
+        Utils::setBit(mmu->getRef(MMU::IF), 1, true);
+    }
+    statLine = line;
+}
+
+void PPU::disable() {
+    sched->cancel(Event::OAMScanDone);
+    sched->cancel(Event::DrawDone);
+    sched->cancel(Event::LineDone);
+
+    mmu->getRef(MMU::LY) = 0;
+    setMode(0);
+    checkSTAT();
+
+    // a disabled screen shows nothing at all
+    std::fill(frame, frame + WIDTH * HEIGHT, SHADES[0]);
+}
+
+void PPU::renderLine(int line) {
+    u8 LCDC = mmu->read8(MMU::LCDC);
+    u32 *out = frame + line * WIDTH;
+
+    // the palette index of each background / window pixel, which sprites
+    // need to know to decide whether they are hidden behind it
+    u8 indices[WIDTH] = {0};
+    if (Utils::getBit(LCDC, 0)) {
+        renderBackground(line, indices);
+        if (Utils::getBit(LCDC, 5)) {
+            renderWindow(line, indices);
+        }
+    }
+
+    u8 BGP = mmu->read8(MMU::BGP);
+    u32 palette[4];
+    for (int i = 0; i < 4; i++) {
+        palette[i] = SHADES[(BGP >> (i * 2)) & 0x03];
+    }
+    Pixels::get().mapPalette(indices, palette, out, WIDTH);
+
+    if (Utils::getBit(LCDC, 1)) {
+        renderSprites(line, indices, out);
+    }
+}
+
+// tile indices in the maps either count up from 0x8000, or (when LCDC bit 4
+// is clear) are signed and count from 0x9000
+static int getTileIndex(u8 LCDC, u8 index) {
+    return Utils::getBit(LCDC, 4) ? index : 256 + (s8)index;
+}
+
+void PPU::renderBackground(int line, u8 *indices) {
+    const u8 *vram = mmu->getVRAM();
+    u8 LCDC = mmu->read8(MMU::LCDC);
+    u8 SCX = mmu->read8(MMU::SCX);
+    u8 SCY = mmu->read8(MMU::SCY);
+
+    // the background is a 32x32 map of tiles, wrapping around at the edges
+    u8 y = line + SCY;
+    const u8 *map = vram + (Utils::getBit(LCDC, 3) ? 0x1C00 : 0x1800) +
+                    (y / 8) * 32;
+
+    int column = SCX / 8;
+    int fine = SCX % 8;
+    for (int x = 0; x < WIDTH; column++) {
+        int tile = getTileIndex(LCDC, map[column % 32]);
+        const u8 *row = getTileRow(tile, y % 8);
+        int count = std::min(8 - fine, WIDTH - x);
+        std::copy(row + fine, row + fine + count, indices + x);
+        x += count;
+        fine = 0;
+    }
+}
+
+void PPU::renderWindow(int line, u8 *indices) {
+    const u8 *vram = mmu->getVRAM();
+    u8 LCDC = mmu->read8(MMU::LCDC);
+    u8 WY = mmu->read8(MMU::WY);
+    int left = mmu->read8(MMU::WX) - 7;
+
+    if (line < WY || left >= WIDTH) {
+        return;
+    }
+
+    const u8 *map = vram + (Utils::getBit(LCDC, 6) ? 0x1C00 : 0x1800) +
+                    (windowLine / 8) * 32;
+
+    for (int x = std::max(left, 0); x < WIDTH; x++) {
+        int wx = x - left;
+        const u8 *row = getTileRow(getTileIndex(LCDC, map[wx / 8]),
+                                   windowLine % 8);
+        indices[x] = row[wx % 8];
+    }
+    windowLine++;
+}
+
+void PPU::renderSprites(int line, const u8 *indices, u32 *out) {
+    const u8 *oam = mmu->getOAM();
+    int height = Utils::getBit(mmu->read8(MMU::LCDC), 2) ? 16 : 8;
+
+    // only the first 10 sprites (in OAM order) on the line are drawn
+    int visible[10];
+    int count = 0;
+    for (int i = 0; i < 40 && count < 10; i++) {
+        int top = oam[i * 4] - 16;
+        if (line >= top && line < top + height) {
+            visible[count++] = i;
+        }
+    }
+
+    // where sprites overlap, the one furthest left (or first in OAM) wins -
+    // so draw them the other way round, letting the winner go on top
+    std::stable_sort(visible, visible + count, [oam](int a, int b) {
+        return oam[a * 4 + 1] < oam[b * 4 + 1];
+    });
+
+    u8 OBP[2] = {mmu->read8(MMU::OBP0), mmu->read8(MMU::OBP1)};
+    for (int i = count - 1; i >= 0; i--) {
+        const u8 *sprite = oam + visible[i] * 4;
+        int left = sprite[1] - 8;
+        u8 attributes = sprite[3];
+        u8 palette = OBP[Utils::getBit(attributes, 4)];
+        bool behind = Utils::getBit(attributes, 7);
+
+        int y = line - (sprite[0] - 16);
+        if (Utils::getBit(attributes, 6)) {
+            y = height - 1 - y;
+        }
+
+        // tall sprites are a pair of tiles, ignoring bit 0 of the index
+        int tile = height == 16 ? (sprite[2] & 0xFE) + y / 8 : sprite[2];
+        const u8 *row = getTileRow(tile, y % 8);
+        bool flipX = Utils::getBit(attributes, 5);
+
+        for (int px = 0; px < 8; px++) {
+            int x = left + px;
+            if (x < 0 || x >= WIDTH) {
+                continue;
+            }
+
+            // colour 0 is transparent, and sprites behind the background
+            // only show through its colour 0
+            u8 index = row[flipX ? 7 - px : px];
+            if (!index || (behind && indices[x])) {
+                continue;
+            }
+            out[x] = SHADES[(palette >> (index * 2)) & 0x03];
+        }
+    }
+}
@@ -0,0 +1,225 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <iterator>
+#include <cstdio>
+
+Profiler::Profiler() {
+    nodes.push_back({0, 0, 0, 0, 0});
+}
+
+Profiler::Site &Profiler::getSite(u16 bank, u16 pc) {
+    size_t index = (size_t)bank * 4 + (pc >> 14);
+    if (index >= pages.size()) {
+        pages.resize(index + 1);
+    }
+    std::unique_ptr<Page> &page = pages[index];
+    if (!page) {
+        page.reset(new Page());
+        page->fill({0, 0, 0, 0, false});
+    }
+    return (*page)[pc & 0x3FFF];
+}
+
+void Profiler::countOp(u16 bank, u16 pc, u16 op, int cycles, bool branch,
+                       bool taken) {
+    Site &site = getSite(bank, pc);
+    site.count++;
+    site.cycles += cycles;
+    site.op = op;
+    if (branch) {
+        site.branch = true;
+        site.taken += taken;
+    }
+
+    opCounts[op]++;
+    opCycles[op] += cycles;
+    totalCycles += cycles;
+    nodes[current].cycles += cycles;
+}
+
+void Profiler::countHalt(int cycles) {
+    haltedCycles += cycles;
+    nodes[current].halted += cycles;
+}
+
+void Profiler::enter(u16 bank, u16 pc, u16 sp) {
+    // past the limit, calls are left out, and so are their returns (which
+    // won't bring SP back up to the last call that was counted)
+    if (stack.size() >= MAX_DEPTH) {
+        return;
+    }
+
+    u32 target = (u32)bank << 16 | pc;
+    auto found = children.find({current, target});
+    if (found == children.end()) {
+        found = children.insert({{current, target}, (u32)nodes.size()}).first;
+        nodes.push_back({bank, pc, current, 0, 0});
+    }
+
+    current = found->second;
+    stack.push_back({current, sp});
+}
+
+void Profiler::leave(u16 sp) {
+    // a return may unwind more than one call, if the code in between threw
+    // return addresses away - and none at all, if it was really a jump to an
+    // address the code pushed itself
+    while (!stack.empty() && stack.back().sp <= sp) {
+        stack.pop_back();
+    }
+    current = stack.empty() ? 0 : stack.back().node;
+}
+
+std::string Profiler::getName(u16 bank, u16 pc) {
+    char name[16];
+    std::snprintf(name, sizeof(name), "%02X:%04X", bank, pc);
+    return name;
+}
+
+std::string Profiler::getOpName(u16 op) {
+    char name[8];
+    if (op >= 0x100) {
+        std::snprintf(name, sizeof(name), "CB %02X", op & 0xFF);
+    } else {
+        std::snprintf(name, sizeof(name), "%02X", op);
+    }
+    return name;
+}
+
+void Profiler::writeReport(std::ostream &out, int top) {
+    struct Entry {
+        u16 bank;
+        u16 pc;
+        const Site *site;
+    };
+
+    std::vector<Entry> sites;
+    u64 totalOps = 0;
+    for (size_t index = 0; index < pages.size(); index++) {
+        if (!pages[index]) {
+            continue;
+        }
+        for (u16 i = 0; i < 0x4000; i++) {
+            const Site &site = (*pages[index])[i];
+            if (site.count) {
+                sites.push_back({(u16)(index / 4),
+                                 (u16)((index % 4) << 14 | i), &site});
+                totalOps += site.count;
+            }
+        }
+    }
+
+    char line[128];
+    auto percent = [&](u64 cycles) {
+        return totalCycles ? 100.0 * cycles / totalCycles : 0.0;
+    };
+
+    std::snprintf(line, sizeof(line),
+                  "%llu ops, %llu cycles, %llu more halted\n",
+                  (unsigned long long)totalOps,
+                  (unsigned long long)totalCycles,
+                  (unsigned long long)haltedCycles);
+    out << line;
+
+    // hottest addresses
+    std::sort(sites.begin(), sites.end(), [](const Entry &a, const Entry &b) {
+        return a.site->cycles > b.site->cycles;
+    });
+    out << "\naddress       count      cycles       %  op\n";
+    for (int i = 0; i < top && i < (int)sites.size(); i++) {
+        const Entry &entry = sites[i];
+        std::snprintf(line, sizeof(line), "%s %10llu %11llu %6.2f%%  %s\n",
+                      getName(entry.bank, entry.pc).c_str(),
+                      (unsigned long long)entry.site->count,
+                      (unsigned long long)entry.site->cycles,
+                      percent(entry.site->cycles),
+                      getOpName(entry.site->op).c_str());
+        out << line;
+    }
+
+    // opcodes
+    std::vector<u16> ops;
+    for (u16 op = 0; op < 0x200; op++) {
+        if (opCounts[op]) {
+            ops.push_back(op);
+        }
+    }
+    std::sort(ops.begin(), ops.end(), [&](u16 a, u16 b) {
+        return opCycles[a] > opCycles[b];
+    });
+    out << "\nop           count      cycles       %\n";
+    for (int i = 0; i < top && i < (int)ops.size(); i++) {
+        std::snprintf(line, sizeof(line), "%-5s %11llu %11llu %6.2f%%\n",
+                      getOpName(ops[i]).c_str(),
+                      (unsigned long long)opCounts[ops[i]],
+                      (unsigned long long)opCycles[ops[i]],
+                      percent(opCycles[ops[i]]));
+        out << line;
+    }
+
+    // conditional branches, most often run first
+    std::vector<Entry> branches;
+    std::copy_if(sites.begin(), sites.end(), std::back_inserter(branches),
+                 [](const Entry &entry) { return entry.site->branch; });
+    std::sort(branches.begin(), branches.end(),
+              [](const Entry &a, const Entry &b) {
+                  return a.site->count > b.site->count;
+              });
+    out << "\nbranch        count       taken       %  op\n";
+    for (int i = 0; i < top && i < (int)branches.size(); i++) {
+        const Entry &entry = branches[i];
+        std::snprintf(line, sizeof(line), "%s %10llu %11llu %6.2f%%  %s\n",
+                      getName(entry.bank, entry.pc).c_str(),
+                      (unsigned long long)entry.site->count,
+                      (unsigned long long)entry.site->taken,
+                      100.0 * entry.site->taken / entry.site->count,
+                      getOpName(entry.site->op).c_str());
+        out << line;
+    }
+
+    // cycles spent in each function itself, however it was reached (with
+    // the top level, outside of any call, under a key of its own)
+    const u32 ROOT = 0xFFFFFFFF;
+    std::map<u32, u64> functions;
+    functions[ROOT] = nodes[0].cycles;
+    for (size_t i = 1; i < nodes.size(); i++) {
+        functions[(u32)nodes[i].bank << 16 | nodes[i].pc] += nodes[i].cycles;
+    }
+    std::vector<std::pair<u32, u64>> sorted(functions.begin(),
+                                            functions.end());
+    std::sort(sorted.begin(), sorted.end(),
+              [](const std::pair<u32, u64> &a, const std::pair<u32, u64> &b) {
+                  return a.second > b.second;
+              });
+    out << "\nfunction          cycles       %\n";
+    for (int i = 0; i < top && i < (int)sorted.size(); i++) {
+        u32 key = sorted[i].first;
+        std::string name = key == ROOT ? "root"
+                                       : getName(key >> 16, key & 0xFFFF);
+        std::snprintf(line, sizeof(line), "%-7s %15llu %6.2f%%\n",
+                      name.c_str(),
+                      (unsigned long long)sorted[i].second,
+                      percent(sorted[i].second));
+        out << line;
+    }
+}
+
+void Profiler::writeFolded(std::ostream &out) {
+    // every node comes after its parent, so the chains can be built up in
+    // one pass
+    std::vector<std::string> chains(nodes.size());
+    chains[0] = "root";
+    for (u32 i = 0; i < nodes.size(); i++) {
+        const Node &node = nodes[i];
+        if (i) {
+            chains[i] = chains[node.parent] + ";" +
+                        getName(node.bank, node.pc);
+        }
+        if (node.cycles) {
+            out << chains[i] << " " << node.cycles << "\n";
+        }
+        if (node.halted) {
+            out << chains[i] << ";halt " << node.halted << "\n";
+        }
+    }
+}
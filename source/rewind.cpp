@@ -0,0 +1,145 @@
+#include "rewind.hpp"
+
+void Rewind::bindMMU(MMU *target) {
+    mmu = target;
+}
+
+void Rewind::setup(size_t capacity) {
+    ring.assign(capacity, 0);
+    entries.clear();
+    writePos = 0;
+
+    // snapshots are relative to the current contents of RAM
+    u32 chunks = mmu->getChunkCount();
+    shadow.resize(chunks * MMU::CHUNK_SIZE);
+    memcpy(shadow.data(), mmu->getChunk(0), shadow.size());
+    mmu->clearDirtyChunks();
+}
+
+bool Rewind::isEnabled() {
+    return !ring.empty();
+}
+
+void Rewind::push(const std::vector<u8> &core) {
+    // find the chunks that really changed - a chunk may have been written
+    // with the same values it already held
+    const u8 *dirty = mmu->getDirtyChunks();
+    u32 chunks = mmu->getChunkCount();
+    changed.clear();
+    for (u32 i = 0; i < chunks; i++) {
+        const u8 *old = &shadow[i * MMU::CHUNK_SIZE];
+        if (dirty[i] && memcmp(mmu->getChunk(i), old, MMU::CHUNK_SIZE)) {
+            changed.push_back(i);
+        }
+    }
+
+    EntryHeader header = {(u32)core.size(), (u32)changed.size()};
+    size_t chunkSize = sizeof(u32) + MMU::CHUNK_SIZE;
+    size_t size = sizeof(header) + core.size() + changed.size() * chunkSize;
+
+    u8 *pos = allocate(size);
+    if (!pos) {
+        return;
+    }
+
+    memcpy(pos, &header, sizeof(header));
+    pos += sizeof(header);
+    memcpy(pos, core.data(), core.size());
+    pos += core.size();
+
+    // store the old contents of each changed chunk, then bring the shadow
+    // copy up to date
+    for (u32 i : changed) {
+        u8 *old = &shadow[i * MMU::CHUNK_SIZE];
+        memcpy(pos, &i, sizeof(u32));
+        memcpy(pos + sizeof(u32), old, MMU::CHUNK_SIZE);
+        memcpy(old, mmu->getChunk(i), MMU::CHUNK_SIZE);
+        pos += chunkSize;
+    }
+
+    mmu->clearDirtyChunks();
+}
+
+bool Rewind::pop(std::vector<u8> &core) {
+    if (entries.empty()) {
+        return false;
+    }
+
+    // put back everything written since the newest snapshot
+    const u8 *dirty = mmu->getDirtyChunks();
+    u32 chunks = mmu->getChunkCount();
+    for (u32 i = 0; i < chunks; i++) {
+        if (dirty[i]) {
+            memcpy(mmu->getChunk(i), &shadow[i * MMU::CHUNK_SIZE],
+                   MMU::CHUNK_SIZE);
+        }
+    }
+    mmu->clearDirtyChunks();
+
+    Entry entry = entries.back();
+    entries.pop_back();
+    writePos = entry.offset;
+
+    const u8 *pos = &ring[entry.offset];
+    EntryHeader header;
+    memcpy(&header, pos, sizeof(header));
+    pos += sizeof(header);
+    core.assign(pos, pos + header.coreSize);
+    pos += header.coreSize;
+
+    // step the shadow copy back to the snapshot before this one - RAM now
+    // differs from it in those chunks, so they are marked dirty again
+    for (u32 n = 0; n < header.chunkCount; n++) {
+        u32 i;
+        memcpy(&i, pos, sizeof(u32));
+        memcpy(&shadow[i * MMU::CHUNK_SIZE], pos + sizeof(u32),
+               MMU::CHUNK_SIZE);
+        mmu->markChunkDirty(i);
+        pos += sizeof(u32) + MMU::CHUNK_SIZE;
+    }
+    return true;
+}
+
+size_t Rewind::getCount() {
+    return entries.size();
+}
+
+size_t Rewind::getUsed() {
+    size_t used = 0;
+    for (const Entry &entry : entries) {
+        used += entry.size;
+    }
+    return used;
+}
+
+u8 *Rewind::allocate(size_t size) {
+    if (size > ring.size()) {
+        return nullptr;
+    }
+
+    // entries never wrap around the end of the ring - if this one won't fit,
+    // it starts again from the beginning, and everything between here and
+    // the end (necessarily the oldest entries) is dropped
+    if (writePos + size > ring.size()) {
+        while (!entries.empty() && entries.front().offset >= writePos) {
+            entries.pop_front();
+        }
+        writePos = 0;
+    }
+
+    // then drop the oldest entries until there is room
+    while (!entries.empty()) {
+        const Entry &oldest = entries.front();
+        bool overlaps = oldest.offset < writePos + size &&
+                        writePos < oldest.offset + oldest.size;
+        if (!overlaps) {
+            break;
+        }
+        entries.pop_front();
+    }
+
+    entries.push_back({writePos, size});
+    u8 *pos = &ring[writePos];
+    writePos += size;
+    return pos;
+}
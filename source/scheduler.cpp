@@ -0,0 +1,85 @@
+#include "scheduler.hpp"
+
+void Scheduler::reset() {
+    now = 0;
+    heap = {};
+    for (int i = 0; i < (int)Event::COUNT; i++) {
+        generation[i] = 0;
+        pending[i] = false;
+    }
+}
+
+void Scheduler::schedule(Event ev, u64 when) {
+    int i = (int)ev;
+    generation[i]++;
+    pending[i] = true;
+    deadline[i] = when;
+    heap.push({when, ev, generation[i]});
+}
+
+void Scheduler::cancel(Event ev) {
+    int i = (int)ev;
+    generation[i]++;
+    pending[i] = false;
+}
+
+bool Scheduler::isPending(Event ev) {
+    return pending[(int)ev];
+}
+
+u64 Scheduler::nextDeadline() {
+    dropStale();
+    return heap.empty() ? UINT64_MAX : heap.top().when;
+}
+
+bool Scheduler::popDue(Event &ev, u64 &when) {
+    dropStale();
+    if (heap.empty() || heap.top().when > now) {
+        return false;
+    }
+
+    ev = heap.top().ev;
+    when = heap.top().when;
+    pending[(int)ev] = false;
+    heap.pop();
+    return true;
+}
+
+void Scheduler::saveState(State::Writer &out) {
+    SavedState state = {};
+    state.now = now;
+    for (int i = 0; i < (int)Event::COUNT; i++) {
+        // deadlines of events that aren't pending are left over from when
+        // they last fired, so aren't saved - equal states save identically
+        state.pending[i] = pending[i];
+        state.deadline[i] = pending[i] ? deadline[i] : 0;
+    }
+    out.write(state);
+}
+
+bool Scheduler::loadState(State::Reader &in) {
+    SavedState state;
+    if (!in.read(state)) {
+        return false;
+    }
+
+    // rebuild the heap from scratch, which also drops any stale entries
+    reset();
+    now = state.now;
+    for (int i = 0; i < (int)Event::COUNT; i++) {
+        if (state.pending[i]) {
+            schedule((Event)i, state.deadline[i]);
+        }
+    }
+    return true;
+}
+
+void Scheduler::dropStale() {
+    while (!heap.empty()) {
+        const Entry &top = heap.top();
+        if (pending[(int)top.ev] && top.generation == generation[(int)top.ev]) {
+            return;
+        }
+        heap.pop();
+    }
+}
@@ -0,0 +1,94 @@
+#include "stepbuffer.hpp"
+#include <algorithm>
+#include <cmath>
+
+StepBuffer::StepBuffer(u32 clockRate, u32 sampleRate, u32 maxSamples) {
+    factor = ((u64)sampleRate << FRAC_BITS) / clockRate;
+    buffer.assign(maxSamples + TAPS, 0);
+
+    // each phase is a windowed sinc (a band limited impulse) centred on the
+    // middle of the kernel, shifted along by its fraction of a sample -
+    // summed up, it becomes a band limited step
+    const double pi = 3.14159265358979323846;
+    for (int phase = 0; phase < PHASES; phase++) {
+        double weights[TAPS];
+        double total = 0;
+        for (int i = 0; i < TAPS; i++) {
+            double x = i - (TAPS / 2 - 1) - (double)phase / PHASES;
+
+            // cut off a little below the Nyquist frequency, with a Blackman
+            // window to keep the ripple down
+            double angle = pi * x * 0.95;
+            double sinc = x == 0 ? 1 : std::sin(angle) / angle;
+            double w = (x + TAPS / 2) / TAPS;
+            double window = 0.42 - 0.5 * std::cos(2 * pi * w) +
+                            0.08 * std::cos(4 * pi * w);
+            weights[i] = sinc * window;
+            total += weights[i];
+        }
+
+        // make sure each phase sums to exactly 1, so steps are always the
+        // right size once summed up
+        s32 sum = 0;
+        for (int i = 0; i < TAPS; i++) {
+            kernel[phase][i] = std::lround(weights[i] / total *
+                                           (1 << KERNEL_BITS));
+            sum += kernel[phase][i];
+        }
+        kernel[phase][TAPS / 2] += (1 << KERNEL_BITS) - sum;
+    }
+}
+
+void StepBuffer::addDelta(u64 time, int delta) {
+    u64 pos = time * factor - start;
+    u64 index = pos >> FRAC_BITS;
+    if (index + TAPS > buffer.size()) {
+        return;
+    }
+
+    const s32 *steps = kernel[(pos >> (FRAC_BITS - PHASE_BITS)) % PHASES];
+    s32 *out = &buffer[index];
+    for (int i = 0; i < TAPS; i++) {
+        out[i] += steps[i] * delta;
+    }
+}
+
+void StepBuffer::endFrame(u64 time) {
+    u64 samples = (time * factor - start) >> FRAC_BITS;
+    available = std::min<u64>(samples, buffer.size() - TAPS);
+}
+
+u32 StepBuffer::getAvailable() {
+    return available;
+}
+
+u32 StepBuffer::read(s16 *out, u32 count, int stride) {
+    count = std::min(count, available);
+
+    for (u32 i = 0; i < count; i++) {
+        sum += buffer[i];
+        s32 sample = sum >> KERNEL_BITS;
+        out[i * stride] = std::max(-32768, std::min(32767, sample));
+
+        // let the sum leak away slowly, which removes any DC offset
+        sum -= sum >> 9;
+    }
+
+    // move what is left (including the tails of recent steps) to the front -
+    // nothing can have been added any further along than that
+    u32 remaining = available - count + TAPS;
+    std::copy(buffer.begin() + count, buffer.begin() + count + remaining,
+              buffer.begin());
+    std::fill(buffer.begin() + remaining, buffer.begin() + count + remaining,
+              0);
+    start += (u64)count << FRAC_BITS;
+    available -= count;
+    return count;
+}
+
+void StepBuffer::clear(u64 time) {
+    std::fill(buffer.begin(), buffer.end(), 0);
+    sum = 0;
+    available = 0;
+    start = (time * factor) & ~(((u64)1 << FRAC_BITS) - 1);
+}
@@ -0,0 +1,157 @@
+#include "timer.hpp"
+
+void Timer::bindMMU(MMU *target) {
+    mmu = target;
+}
+
+void Timer::bindScheduler(Scheduler *target) {
+    sched = target;
+}
+
+void Timer::reset() {
+    divStart = sched->now;
+    timaSync = sched->now;
+    tima = 0;
+    scheduleOverflow();
+}
+
+u8 Timer::read(u16 addr) {
+    u64 time = mmu->getTime();
+    if (addr == MMU::DIV) {
+        return (time - divStart) >> 8;
+    }
+
+    syncTIMA(time, mmu->read8(MMU::TAC), mmu->read8(MMU::TMA));
+    return tima;
+}
+
+void Timer::writeDIV() {
+    // resetting the counter makes TAC's bit fall if it was set, which counts
+    // as an edge like any other
+    u64 time = mmu->getTime();
+    u8 TAC = mmu->read8(MMU::TAC);
+    syncTIMA(time, TAC, mmu->read8(MMU::TMA));
+
+    int period = getTIMAPeriod(TAC);
+    bool falls = period && ((time - divStart) & (period / 2));
+    divStart = time;
+    if (falls) {
+        bumpTIMA();
+    }
+    scheduleOverflow();
+}
+
+void Timer::writeTIMA() {
+    // the old value may have overflowed already (see syncTIMA), which still
+    // requests the interrupt
+    syncTIMA(mmu->getTime(), mmu->read8(MMU::TAC), mmu->read8(MMU::TMA));
+    tima = mmu->getRef(MMU::TIMA);
+    scheduleOverflow();
+}
+
+void Timer::writeTMA(u8 oldTMA) {
+    // likewise, an overflow that has happened already reloaded the old value
+    syncTIMA(mmu->getTime(), mmu->read8(MMU::TAC), oldTMA);
+}
+
+void Timer::writeTAC(u8 oldTAC) {
+    // TIMA counts edges of (enabled AND selected bit), so switching to a bit
+    // that is clear, or disabling it, while the old bit is set also counts
+    u64 time = mmu->getTime();
+    syncTIMA(time, oldTAC, mmu->read8(MMU::TMA));
+
+    u64 counter = time - divStart;
+    int oldPeriod = getTIMAPeriod(oldTAC);
+    int newPeriod = getTIMAPeriod(mmu->read8(MMU::TAC));
+    bool wasHigh = oldPeriod && (counter & (oldPeriod / 2));
+    bool isHigh = newPeriod && (counter & (newPeriod / 2));
+    if (wasHigh && !isHigh) {
+        bumpTIMA();
+    }
+    scheduleOverflow();
+}
+
+void Timer::overflow(u64 when) {
+    overflow(when, mmu->read8(MMU::TMA));
+}
+
+void Timer::overflow(u64 when, u8 TMA) {
+    // TIMA is reloaded from TMA, and a TIMER interrupt is requested
+    timaSync = when;
+    tima = TMA;
+    Utils::setBit(mmu->getRef(MMU::IF), 2, true);
+    scheduleOverflow();
+}
+
+void Timer::saveState(State::Writer &out) {
+    SavedState state = {};
+    state.divStart = divStart;
+    state.timaSync = timaSync;
+    state.tima = tima;
+    out.write(state);
+}
+
+bool Timer::loadState(State::Reader &in) {
+    SavedState state;
+    if (!in.read(state)) {
+        return false;
+    }
+    divStart = state.divStart;
+    timaSync = state.timaSync;
+    tima = state.tima;
+    return true;
+}
+
+int Timer::getTIMAPeriod(u8 TAC) {
+    // TAC bit 2 enables TIMA, and bits 0 and 1 select the counter bit -
+    // bits 9, 3, 5 and 7, which fall every 1024, 16, 64 and 256 cycles
+    if (!Utils::getBit(TAC, 2)) {
+        return 0;
+    }
+    switch (TAC & 0x03) {
+        case 0x00: return 1024;
+        case 0x01: return 16;
+        case 0x02: return 64;
+        default: return 256;
+    }
+}
+
+void Timer::syncTIMA(u64 time, u8 TAC, u8 TMA) {
+    // the bit falls whenever the counter reaches a multiple of the period
+    int period = getTIMAPeriod(TAC);
+    if (period) {
+        u64 edges = (time - divStart) / period - (timaSync - divStart) / period;
+
+        // the overflow event is usually handled first, but a write partway
+        // through a run can bring it forward to before the run ends - so it
+        // may have happened already, and TIMA counts on from TMA after it
+        while (edges >= 0x100u - tima) {
+            u64 edge = (timaSync - divStart) / period + (0x100 - tima);
+            edges -= 0x100 - tima;
+            overflow(divStart + edge * period, TMA);
+        }
+        tima += edges;
+    }
+    timaSync = time;
+}
+
+void Timer::bumpTIMA() {
+    if (tima == 0xFF) {
+        overflow(timaSync);
+    } else {
+        tima++;
+    }
+}
+
+void Timer::scheduleOverflow() {
+    int period = getTIMAPeriod(mmu->read8(MMU::TAC));
+    if (!period) {
+        sched->cancel(Event::TIMAOverflow);
+        return;
+    }
+
+    // the edge that takes TIMA past 0xFF, counting on from the last edge
+    // before it was synced
+    u64 edges = (timaSync - divStart) / period + (0x100 - tima);
+    sched->schedule(Event::TIMAOverflow, divStart + edges * period);
+}
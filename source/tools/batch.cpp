@@ -0,0 +1,256 @@
+#include "emulator.hpp"
+#include "threadpool.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "types.hpp"
+
+// gbpp-batch runs a list of independent jobs, each on its own emulator, on a
+// pool of worker threads. Each line of the job list is:
+//
+//     <ROM> <frames> [<input file> | -] [<expected hash> | -]
+//
+// with blank lines and lines starting with '#' ignored. An input file holds
+// lines of '<frame> <buttons>', where the buttons (a hex mask of MMU::JOY_*
+// bits) are held from the start of that frame until the next line.
+
+struct Job {
+    std::string rom;
+    u64 frames = 0;
+    std::string input;
+    std::string expected;
+};
+
+struct Result {
+    u64 frames = 0;
+    u64 cycles = 0;
+    double seconds = 0;
+    std::string hash;
+    std::string status;
+};
+
+void printUsage() {
+    std::cerr << "Usage: ./gbpp-batch [-j THREADS] [--json] [-o FILE] "
+              << "<JOB LIST>\n";
+}
+
+bool readJobs(const std::string &path, std::vector<Job> &jobs) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Could not open job list: " << path << "\n";
+        return false;
+    }
+
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++) {
+        std::istringstream fields(line);
+        Job job;
+        if (!(fields >> job.rom) || job.rom[0] == '#') {
+            continue;
+        }
+        if (!(fields >> job.frames)) {
+            std::cerr << path << ":" << number << ": missing frame count\n";
+            return false;
+        }
+        fields >> job.input >> job.expected;
+        if (job.input == "-") {
+            job.input.clear();
+        }
+        if (job.expected == "-") {
+            job.expected.clear();
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+bool readInput(const std::string &path, std::map<u64, u8> &input) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    u64 frame;
+    unsigned buttons;
+    while (file >> std::dec >> frame >> std::hex >> buttons) {
+        input[frame] = buttons;
+    }
+    return file.eof();
+}
+
+std::string toHex(u64 value) {
+    std::ostringstream out;
+    out << std::hex << std::setw(16) << std::setfill('0') << value;
+    return out.str();
+}
+
+void runJob(const Job &job, Result &result) {
+    std::map<u64, u8> input;
+    if (!job.input.empty() && !readInput(job.input, input)) {
+        result.status = "bad input";
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // emulators are too big to live on a worker's stack
+    std::unique_ptr<Emulator> gameboy(new Emulator(job.rom.c_str()));
+    if (!gameboy->isLoaded()) {
+        result.status = "bad rom";
+        return;
+    }
+
+    auto next = input.begin();
+    for (u64 frame = 0; frame < job.frames; frame++) {
+        if (next != input.end() && next->first == frame) {
+            gameboy->setButtons(next->second);
+            ++next;
+        }
+        gameboy->runFrame();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    result.frames = gameboy->getFrames();
+    result.cycles = gameboy->getTotalCycles();
+    result.seconds = std::chrono::duration<double>(end - start).count();
+    result.hash = toHex(gameboy->getHash());
+
+    if (job.expected.empty()) {
+        result.status = "done";
+    } else if (strtoull(job.expected.c_str(), nullptr, 16) ==
+               strtoull(result.hash.c_str(), nullptr, 16)) {
+        result.status = "pass";
+    } else {
+        result.status = "fail";
+    }
+}
+
+// quote a string for JSON (CSV fields are quoted the same way, which is fine
+// as long as paths don't contain quotes)
+std::string quote(const std::string &text) {
+    std::string out = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out + "\"";
+}
+
+void writeCSV(std::ostream &out, const std::vector<Job> &jobs,
+              const std::vector<Result> &results) {
+    out << "rom,frames,cycles,seconds,hash,expected,status\n";
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const Result &result = results[i];
+        out << quote(jobs[i].rom) << ","
+            << result.frames << ","
+            << result.cycles << ","
+            << result.seconds << ","
+            << result.hash << ","
+            << jobs[i].expected << ","
+            << result.status << "\n";
+    }
+}
+
+void writeJSON(std::ostream &out, const std::vector<Job> &jobs,
+               const std::vector<Result> &results) {
+    out << "[\n";
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const Result &result = results[i];
+        out << "  {\"rom\": " << quote(jobs[i].rom)
+            << ", \"frames\": " << result.frames
+            << ", \"cycles\": " << result.cycles
+            << ", \"seconds\": " << result.seconds
+            << ", \"hash\": " << quote(result.hash)
+            << ", \"expected\": " << quote(jobs[i].expected)
+            << ", \"status\": " << quote(result.status)
+            << (i + 1 < jobs.size() ? "},\n" : "}\n");
+    }
+    out << "]\n";
+}
+
+int main(int argc, char **argv) {
+    const char *jobPath = nullptr;
+    const char *outPath = nullptr;
+    unsigned threads = 0;
+    bool json = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            outPath = argv[++i];
+        } else if (!strcmp(argv[i], "--json")) {
+            json = true;
+        } else if (argv[i][0] != '-' && !jobPath) {
+            jobPath = argv[i];
+        } else {
+            printUsage();
+            return -1;
+        }
+    }
+
+    if (!jobPath) {
+        printUsage();
+        return -1;
+    }
+
+    std::vector<Job> jobs;
+    if (!readJobs(jobPath, jobs)) {
+        return -1;
+    }
+
+    // every job writes only to its own result, so no locking is needed
+    std::vector<Result> results(jobs.size());
+    auto start = std::chrono::steady_clock::now();
+    {
+        ThreadPool pool(threads);
+        for (size_t i = 0; i < jobs.size(); i++) {
+            pool.submit([&jobs, &results, i] { runJob(jobs[i], results[i]); });
+        }
+        pool.wait();
+        threads = pool.size();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    std::ofstream file;
+    if (outPath) {
+        file.open(outPath);
+        if (!file) {
+            std::cerr << "Could not open output: " << outPath << "\n";
+            return -1;
+        }
+    }
+    std::ostream &out = outPath ? file : std::cout;
+
+    if (json) {
+        writeJSON(out, jobs, results);
+    } else {
+        writeCSV(out, jobs, results);
+    }
+
+    // the exit code says whether any job failed to run or match its hash
+    int failed = 0;
+    for (const Result &result : results) {
+        if (result.status != "done" && result.status != "pass") {
+            failed++;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cerr << jobs.size() << " jobs (" << failed << " failed) on "
+              << threads << " threads in " << seconds << "s\n";
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,407 @@
+#include "cpu.hpp"
+#include "mmu.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "types.hpp"
+
+// gbpp-bench times the interpreter on synthetic ROMs. Each opcode is run as
+// a loop of the same op repeated over and over:
+//
+//     LOOP: LD BC,$C280 / LD DE,$C300 / LD HL,$C100 / LD SP,$DFF0
+//           <op> x 32
+//           JP LOOP
+//
+// so every pointer an op might use points at work RAM (or HRAM, for
+// LD (C),A) and is put back each time around. The same loop with nothing in
+// it is timed as well and taken away, which leaves the cost of the ops
+// alone. Ops which change the flow of the program are paired up with
+// whatever takes it back again - calls and RSTs with a RET, RETs with a
+// CALL and JP (HL) with loading HL - and timed as a pair. Each loop is run
+// several times and the best run kept, as the best run is the one least
+// disturbed by anything else on the machine.
+
+const u16 LOOP = 0x0150;
+const u16 SUBROUTINE = 0x0200;
+const int REPEATS = 32;
+
+struct Bench {
+    std::string name;
+    std::string group;
+    std::vector<u8> rom;
+};
+
+struct Timing {
+    double ns = 0;          // per time around the loop
+    double cycles = 0;      // emulated cycles per time around the loop
+    double ops = 0;         // ops run per time around the loop
+};
+
+struct Total {
+    double ns = 0;
+    double cycles = 0;
+    double ops = 0;
+};
+
+// ops which halt, stop or lock up the CPU
+bool isSkipped(u8 op) {
+    static const u8 skipped[] = {0x10, 0x76, 0xCB, 0xD3, 0xDB, 0xDD, 0xE3,
+                                 0xE4, 0xEB, 0xEC, 0xED, 0xF4, 0xFC, 0xFD};
+    return std::find(std::begin(skipped), std::end(skipped), op) !=
+           std::end(skipped);
+}
+
+int getLength(u8 op) {
+    switch (op) {
+        case 0x01: case 0x08: case 0x11: case 0x21: case 0x31:
+        case 0xC2: case 0xC3: case 0xC4: case 0xCA: case 0xCC: case 0xCD:
+        case 0xD2: case 0xD4: case 0xDA: case 0xDC: case 0xEA: case 0xFA:
+            return 3;
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E:
+        case 0x36: case 0x3E: case 0x18: case 0x20: case 0x28: case 0x30:
+        case 0x38: case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6:
+        case 0xEE: case 0xF6: case 0xFE: case 0xE0: case 0xF0: case 0xE8:
+        case 0xF8:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+std::string getGroup(u8 op) {
+    u8 high = op >> 4;
+    u8 low = op & 0x0F;
+
+    if (op >= 0x40 && op < 0x80) {
+        bool memory = (op & 0x07) == 6 || (op & 0xF8) == 0x70;
+        return memory ? "ld (hl)" : "ld r,r";
+    }
+    if (op >= 0x80 && op < 0xC0) {
+        return (op & 0x07) == 6 ? "alu (hl)/d8" : "alu r";
+    }
+    if (high >= 0xC && (low == 0x6 || low == 0xE)) {
+        return "alu (hl)/d8";
+    }
+    if (high >= 0xC && (low == 0x1 || low == 0x5)) {
+        return "push/pop";
+    }
+    if (high >= 0xC && (low == 0x7 || low == 0xF)) {
+        return "call/ret";
+    }
+    switch (op) {
+        case 0x01: case 0x11: case 0x21: case 0x31: case 0x06: case 0x0E:
+        case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E:
+            return "ld imm";
+        case 0x02: case 0x0A: case 0x12: case 0x1A: case 0x22: case 0x2A:
+        case 0x32: case 0x3A: case 0x36: case 0x08: case 0xE0: case 0xF0:
+        case 0xE2: case 0xF2: case 0xEA: case 0xFA:
+            return "ld mem";
+        case 0x09: case 0x19: case 0x29: case 0x39: case 0xE8: case 0xF8:
+        case 0xF9: case 0x03: case 0x0B: case 0x13: case 0x1B: case 0x23:
+        case 0x2B: case 0x33: case 0x3B:
+            return "16-bit";
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: case 0xC2:
+        case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9:
+            return "jump";
+        case 0xC0: case 0xC4: case 0xC8: case 0xC9: case 0xCC: case 0xCD:
+        case 0xD0: case 0xD4: case 0xD8: case 0xD9: case 0xDC:
+            return "call/ret";
+        case 0x00: case 0x07: case 0x0F: case 0x17: case 0x1F: case 0x27:
+        case 0x2F: case 0x37: case 0x3F: case 0xF3: case 0xFB:
+            return "misc";
+        default:
+            return "inc/dec";
+    }
+}
+
+std::string getCBGroup(u8 op) {
+    std::string group = op < 0x40 ? "cb shift" : op < 0x80 ? "cb bit"
+                                                           : "cb res/set";
+    return (op & 0x07) == 6 ? group + " (hl)" : group;
+}
+
+// a blank ROM with a jump to the loop at the entry point, a RET on every
+// RST vector and at the subroutine
+std::vector<u8> makeROM() {
+    std::vector<u8> rom(0x8000, 0x00);
+    for (int vector = 0; vector < 0x40; vector += 8) {
+        rom[vector] = 0xC9;
+    }
+    rom[SUBROUTINE] = 0xC9;
+
+    const u8 entry[] = {0xC3, LOOP & 0xFF, LOOP >> 8};
+    std::copy(std::begin(entry), std::end(entry), rom.begin() + 0x0100);
+    return rom;
+}
+
+// wrap a loop body with the pointer set up and jump back
+std::vector<u8> makeLoop(const std::vector<u8> &body) {
+    std::vector<u8> rom = makeROM();
+    const u8 setup[] = {0x01, 0x80, 0xC2, 0x11, 0x00, 0xC3,
+                        0x21, 0x00, 0xC1, 0x31, 0xF0, 0xDF};
+    const u8 jump[] = {0xC3, LOOP & 0xFF, LOOP >> 8};
+
+    auto at = rom.begin() + LOOP;
+    at = std::copy(std::begin(setup), std::end(setup), at);
+    at = std::copy(body.begin(), body.end(), at);
+    std::copy(std::begin(jump), std::end(jump), at);
+    return rom;
+}
+
+// a loop running the given (base set) op over and over
+std::vector<u8> makeOpLoop(u8 op) {
+    std::vector<u8> body;
+    for (int i = 0; i < REPEATS; i++) {
+        u16 addr = LOOP + 12 + body.size();
+        switch (op) {
+            case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: case 0xD9:
+                // RET cc falls through to a plain RET when not taken
+                body.insert(body.end(), {0xCD, SUBROUTINE & 0xFF,
+                                         SUBROUTINE >> 8});
+                break;
+            case 0xE9: {
+                u16 next = addr + 4;
+                body.insert(body.end(),
+                            {0x21, (u8)next, (u8)(next >> 8), op});
+                break;
+            }
+            case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: {
+                u16 next = addr + 3;
+                body.insert(body.end(), {op, (u8)next, (u8)(next >> 8)});
+                break;
+            }
+            case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC:
+                body.insert(body.end(), {op, SUBROUTINE & 0xFF,
+                                         SUBROUTINE >> 8});
+                break;
+            case 0xE0: case 0xF0:
+                // HRAM
+                body.insert(body.end(), {op, 0x80});
+                break;
+            case 0x08: case 0xEA: case 0xFA: case 0x01: case 0x11: case 0x21:
+                body.insert(body.end(), {op, 0x00, 0xC1});
+                break;
+            case 0x31:
+                body.insert(body.end(), {op, 0xF0, 0xDF});
+                break;
+            default:
+                // relative jumps go to the next op, taken or not
+                body.push_back(op);
+                for (int j = 1; j < getLength(op); j++) {
+                    body.push_back(0x00);
+                }
+                break;
+        }
+    }
+
+    std::vector<u8> rom = makeLoop(body);
+    if (op == 0xC0 || op == 0xC8 || op == 0xD0 || op == 0xD8 || op == 0xD9) {
+        rom[SUBROUTINE] = op;
+        rom[SUBROUTINE + 1] = 0xC9;
+    }
+    return rom;
+}
+
+std::vector<u8> makeCBLoop(u8 op) {
+    std::vector<u8> body;
+    for (int i = 0; i < REPEATS; i++) {
+        body.insert(body.end(), {0xCB, op});
+    }
+    return makeLoop(body);
+}
+
+// a few whole routines of the kind games spend their time in
+std::vector<Bench> getPrograms() {
+    return {
+        // copy 256 bytes from ROM to work RAM
+        {"memcpy", "program", makeLoop({
+            0x21, 0x00, 0x00,       // LD HL,$0000
+            0x11, 0x00, 0xC4,       // LD DE,$C400
+            0x01, 0x00, 0x01,       // LD BC,$0100
+            0x2A,                   // .copy: LD A,(HL+)
+            0x12,                   // LD (DE),A
+            0x13,                   // INC DE
+            0x0B,                   // DEC BC
+            0x78,                   // LD A,B
+            0xB1,                   // OR C
+            0x20, 0xF8,             // JR NZ,.copy
+        })},
+
+        // 8 bit by 8 bit shift and add multiply
+        {"multiply", "program", makeLoop({
+            0x06, 0xB7,             // LD B,$B7
+            0x11, 0x5D, 0x00,       // LD DE,$005D
+            0x21, 0x00, 0x00,       // LD HL,$0000
+            0x0E, 0x08,             // LD C,8
+            0xCB, 0x38,             // .bit: SRL B
+            0x30, 0x01,             // JR NC,.skip
+            0x19,                   // ADD HL,DE
+            0xCB, 0x23,             // .skip: SLA E
+            0xCB, 0x12,             // RL D
+            0x0D,                   // DEC C
+            0x20, 0xF4,             // JR NZ,.bit
+        })},
+
+        // 16 bit sum of 256 bytes of ROM
+        {"checksum", "program", makeLoop({
+            0x21, 0x00, 0x00,       // LD HL,$0000
+            0x11, 0x00, 0x00,       // LD DE,$0000
+            0x0E, 0x00,             // LD C,0
+            0x2A,                   // .add: LD A,(HL+)
+            0x83,                   // ADD A,E
+            0x5F,                   // LD E,A
+            0x30, 0x01,             // JR NC,.skip
+            0x14,                   // INC D
+            0x0D,                   // .skip: DEC C
+            0x20, 0xF7,             // JR NZ,.add
+        })},
+    };
+}
+
+// run a ROM for the given number of cycles at a time, returning the best
+// time taken to go around its loop once
+Timing measure(const std::vector<u8> &rom, int runs, u64 target) {
+    // the CPU's code cache is too big to live on the stack
+    std::unique_ptr<MMU> mmu(new MMU());
+    std::unique_ptr<CPU> cpu(new CPU());
+    mmu->loadROM(rom.data(), rom.size());
+    cpu->bindMMU(mmu.get());
+    cpu->reset();
+
+    // there are no events to run up to here, so a loop that looked like it
+    // was polling would be skipped through for the whole of run()'s budget
+    cpu->setIdleSkip(false);
+
+    // step through once to count the ops and cycles in the loop
+    Timing timing;
+    while (cpu->getPC() != LOOP) {
+        cpu->step();
+    }
+    do {
+        timing.cycles += cpu->step();
+        timing.ops++;
+    } while (cpu->getPC() != LOOP);
+
+    // the first run just warms up the code cache
+    double best = 0;
+    for (int run = 0; run <= runs; run++) {
+        u64 cycles = 0;
+        auto start = std::chrono::steady_clock::now();
+        while (cycles < target) {
+            cycles += cpu->run();
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        double ns = std::chrono::duration<double, std::nano>(end - start)
+                        .count() / (cycles / timing.cycles);
+        if (run == 1 || (run > 1 && ns < best)) {
+            best = ns;
+        }
+    }
+    timing.ns = best;
+    return timing;
+}
+
+void printUsage() {
+    std::fprintf(stderr, "Usage: ./gbpp-bench [-r RUNS] [-c CYCLES] [-v]\n");
+}
+
+// 'ns' and 'cycles' are totals over 'ops' ops
+void printRow(const char *name, int count, double ns, double ops,
+              double cycles) {
+    std::printf("%-18s %5d %8.2f %9.1f\n", name, count, ns / ops,
+                ns > 0 ? cycles / ns * 1000 : 0);
+}
+
+int main(int argc, char **argv) {
+    int runs = 5;
+    u64 target = 1000000;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            runs = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            target = std::max(1000ull, strtoull(argv[++i], nullptr, 10));
+        } else if (!strcmp(argv[i], "-v")) {
+            verbose = true;
+        } else {
+            printUsage();
+            return -1;
+        }
+    }
+
+    std::vector<Bench> benches;
+    for (int op = 0; op < 0x100; op++) {
+        if (!isSkipped(op)) {
+            char name[8];
+            std::snprintf(name, sizeof(name), "%02X", op);
+            benches.push_back({name, getGroup(op), makeOpLoop(op)});
+        }
+    }
+    for (int op = 0; op < 0x100; op++) {
+        char name[8];
+        std::snprintf(name, sizeof(name), "CB %02X", op);
+        benches.push_back({name, getCBGroup(op), makeCBLoop(op)});
+    }
+
+    std::printf("gbpp-bench: best of %d runs of %llu cycles each\n\n", runs,
+                (unsigned long long)target);
+
+    // the empty loop is the overhead to take away from every other loop
+    Timing empty = measure(makeLoop({}), runs, target);
+
+    // groups are listed in the order they first appear
+    std::vector<std::string> order;
+    std::map<std::string, Total> groups;
+    Total all;
+
+    if (verbose) {
+        std::printf("%-18s %5s %8s %9s\n", "op", "ops", "ns/op", "MHz");
+    }
+    for (const Bench &bench : benches) {
+        Timing timing = measure(bench.rom, runs, target);
+        double ns = std::max(0.0, timing.ns - empty.ns);
+        double cycles = timing.cycles - empty.cycles;
+        double ops = timing.ops - empty.ops;
+
+        if (!groups.count(bench.group)) {
+            order.push_back(bench.group);
+        }
+        for (Total *total : {&groups[bench.group], &all}) {
+            total->ns += ns;
+            total->cycles += cycles;
+            total->ops += ops;
+        }
+        if (verbose) {
+            printRow(bench.name.c_str(), ops, ns, ops, cycles);
+        }
+    }
+    if (verbose) {
+        std::printf("\n");
+    }
+
+    // each op counts the same within a group, however many it was paired up
+    // with, so the group's figures are sums over all of its loops
+    std::printf("%-18s %5s %8s %9s\n", "group", "ops", "ns/op", "MHz");
+    for (const std::string &name : order) {
+        const Total &total = groups[name];
+        printRow(name.c_str(), total.ops, total.ns, total.ops, total.cycles);
+    }
+    printRow("all", all.ops, all.ns, all.ops, all.cycles);
+
+    std::printf("\n%-18s %5s %8s %9s\n", "program", "ops", "ns/op", "MHz");
+    for (const Bench &bench : getPrograms()) {
+        Timing timing = measure(bench.rom, runs, target);
+        printRow(bench.name.c_str(), timing.ops, timing.ns, timing.ops,
+                 timing.cycles);
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+#include "emulator.hpp"
+#include "threadpool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "types.hpp"
+
+// gbpp-test runs test ROMs headlessly, all at once across a pool of
+// threads, and works out whether each passed from how it reports its
+// result:
+//
+//   - blargg's tests (cpu_instrs, instr_timing, mem_timing...) print their
+//     results over the link cable, ending in "Passed" or "Failed", and the
+//     newer ones also write them to cartridge RAM at 0xA004, with a status
+//     code at 0xA000 once the signature DE B0 61 is in place at 0xA001
+//   - mooneye's tests send the Fibonacci numbers 3, 5, 8, 13, 21, 34 over
+//     the link cable to pass, or six 0x42 bytes to fail
+//
+// A ROM that does neither within the time limit has timed out.
+
+namespace fs = std::filesystem;
+
+enum class Status { Running, Pass, Fail, Timeout, Error };
+
+struct Test {
+    std::string rom;
+    Status status = Status::Running;
+    std::string message;
+    std::string output;
+    double emulated = 0;
+    double seconds = 0;
+};
+
+// frames to keep running once a result is seen, so the rest of the message
+// (such as which test failed) has time to come through
+const int GRACE_FRAMES = 30;
+
+void printUsage() {
+    std::cerr << "Usage: ./gbpp-test [-j THREADS] [-t SECONDS] [-v] "
+              << "<ROM | DIRECTORY>...\n";
+}
+
+// add the ROM, or all the ROMs under the directory
+bool findROMs(const std::string &path, std::vector<std::string> &roms) {
+    std::error_code error;
+    if (fs::is_regular_file(path, error)) {
+        roms.push_back(path);
+        return true;
+    }
+    if (!fs::is_directory(path, error)) {
+        return false;
+    }
+
+    std::vector<std::string> found;
+    for (const auto &entry : fs::recursive_directory_iterator(path, error)) {
+        std::string extension = entry.path().extension().string();
+        if (entry.is_regular_file() &&
+            (extension == ".gb" || extension == ".gbc")) {
+            found.push_back(entry.path().string());
+        }
+    }
+    std::sort(found.begin(), found.end());
+    roms.insert(roms.end(), found.begin(), found.end());
+    return true;
+}
+
+// the last non-empty line of some text
+std::string lastLine(const std::string &text) {
+    size_t end = text.find_last_not_of("\n\r ");
+    if (end == std::string::npos) {
+        return "";
+    }
+    size_t start = text.find_last_of('\n', end);
+    start = start == std::string::npos ? 0 : start + 1;
+    return text.substr(start, end - start + 1);
+}
+
+// look for a result in the link cable output or cartridge RAM
+Status check(Emulator &gameboy, const std::vector<u8> &serial,
+             std::string &message) {
+    static const u8 PASSED[] = {3, 5, 8, 13, 21, 34};
+    if (serial.size() >= 6) {
+        const u8 *last = serial.data() + serial.size() - 6;
+        if (std::equal(last, last + 6, PASSED)) {
+            message = "Fibonacci registers";
+            return Status::Pass;
+        }
+        auto isFail = [](u8 byte) { return byte == 0x42; };
+        if (std::all_of(last, last + 6, isFail)) {
+            message = "failure registers";
+            return Status::Fail;
+        }
+    }
+
+    std::string text(serial.begin(), serial.end());
+    if (text.find("Passed") != std::string::npos) {
+        message = lastLine(text);
+        return Status::Pass;
+    }
+    if (text.find("Failed") != std::string::npos) {
+        message = lastLine(text);
+        return Status::Fail;
+    }
+
+    if (gameboy.peek(0xA001) == 0xDE && gameboy.peek(0xA002) == 0xB0 &&
+        gameboy.peek(0xA003) == 0x61 && gameboy.peek(0xA000) != 0x80) {
+        std::string written;
+        for (u16 addr = 0xA004; addr < 0xC000; addr++) {
+            u8 c = gameboy.peek(addr);
+            if (!c) {
+                break;
+            }
+            written += c;
+        }
+        message = lastLine(written);
+        return gameboy.peek(0xA000) ? Status::Fail : Status::Pass;
+    }
+    return Status::Running;
+}
+
+void runTest(Test &test, u64 maxFrames) {
+    auto start = std::chrono::steady_clock::now();
+
+    // emulators are too big to live on a worker's stack
+    std::unique_ptr<Emulator> gameboy(new Emulator(test.rom.c_str()));
+    if (!gameboy->isLoaded()) {
+        test.status = Status::Error;
+        test.message = "could not open ROM";
+        return;
+    }
+    std::vector<u8> serial;
+    gameboy->setSerialOutput(&serial);
+
+    int grace = -1;
+    for (u64 frame = 0; frame < maxFrames && grace; frame++) {
+        gameboy->runFrame();
+        Status status = check(*gameboy, serial, test.message);
+        if (status != Status::Running) {
+            test.status = status;
+            grace = grace < 0 ? GRACE_FRAMES : grace - 1;
+        }
+    }
+    if (test.status == Status::Running) {
+        test.status = Status::Timeout;
+        test.message = lastLine(std::string(serial.begin(), serial.end()));
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    test.output.assign(serial.begin(), serial.end());
+    test.emulated = (double)gameboy->getTotalCycles() / Emulator::CLOCK_SPEED;
+    test.seconds = std::chrono::duration<double>(end - start).count();
+}
+
+const char *getName(Status status) {
+    switch (status) {
+        case Status::Pass:
+            return "PASS";
+        case Status::Fail:
+            return "FAIL";
+        case Status::Timeout:
+            return "TIMEOUT";
+        default:
+            return "ERROR";
+    }
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> roms;
+    unsigned threads = 0;
+    double limit = 120;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            limit = strtod(argv[++i], nullptr);
+        } else if (!strcmp(argv[i], "-v")) {
+            verbose = true;
+        } else if (argv[i][0] != '-') {
+            if (!findROMs(argv[i], roms)) {
+                std::cerr << "Could not find test ROMs: " << argv[i] << "\n";
+                return -1;
+            }
+        } else {
+            printUsage();
+            return -1;
+        }
+    }
+
+    if (roms.empty()) {
+        printUsage();
+        return -1;
+    }
+
+    // the time limit is in emulated seconds
+    u64 maxFrames = limit * Emulator::CLOCK_SPEED /
+                    Emulator::CYCLES_PER_FRAME;
+
+    // every test writes only to itself, so no locking is needed
+    std::vector<Test> tests(roms.size());
+    auto start = std::chrono::steady_clock::now();
+    {
+        ThreadPool pool(threads);
+        for (size_t i = 0; i < roms.size(); i++) {
+            tests[i].rom = roms[i];
+            pool.submit([&tests, i, maxFrames] {
+                runTest(tests[i], maxFrames);
+            });
+        }
+        pool.wait();
+        threads = pool.size();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    int passed = 0;
+    for (const Test &test : tests) {
+        passed += test.status == Status::Pass;
+
+        char times[64];
+        std::snprintf(times, sizeof(times), "(%.1fs emulated, %.2fs)",
+                      test.emulated, test.seconds);
+        std::cout << std::left << std::setw(8) << getName(test.status)
+                  << test.rom << "  " << times;
+        if (test.status != Status::Pass && !test.message.empty()) {
+            std::cout << "  " << test.message;
+        }
+        std::cout << "\n";
+
+        if (verbose && test.status != Status::Pass && !test.output.empty()) {
+            std::cout << test.output << "\n";
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cerr << passed << "/" << tests.size() << " passed on " << threads
+              << " threads in " << seconds << "s\n";
+
+    return passed == (int)tests.size() ? 0 : 1;
+}
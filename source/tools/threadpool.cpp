@@ -0,0 +1,96 @@
+#include "threadpool.hpp"
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned threads) {
+    if (!threads) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (unsigned i = 0; i < threads; i++) {
+        queues.emplace_back(new Queue);
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::work, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    Queue &queue = *queues[nextQueue];
+    nextQueue = (nextQueue + 1) % queues.size();
+
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queued++;
+        pending++;
+    }
+    wake.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this] { return pending == 0; });
+}
+
+unsigned ThreadPool::size() {
+    return workers.size();
+}
+
+void ThreadPool::work(unsigned index) {
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (true) {
+        wake.wait(guard, [this] { return stopping || queued > 0; });
+        if (!queued) {
+            return;
+        }
+
+        // claiming one of the queued tasks guarantees there is one to take
+        queued--;
+        guard.unlock();
+
+        std::function<void()> task = take(index);
+        task();
+
+        guard.lock();
+        if (--pending == 0) {
+            done.notify_all();
+        }
+    }
+}
+
+std::function<void()> ThreadPool::take(unsigned index) {
+    // newest task from our own queue first, as it is most likely to still be
+    // in cache, otherwise the oldest from somebody else's
+    for (unsigned i = 0; ; i = (i + 1) % queues.size()) {
+        Queue &queue = *queues[(index + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(queue.lock);
+
+        if (!queue.tasks.empty()) {
+            std::function<void()> task;
+            if (i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            return task;
+        }
+    }
+}
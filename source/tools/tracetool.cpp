@@ -0,0 +1,229 @@
+#include "trace.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "types.hpp"
+
+// gbpp-trace turns a binary trace written by 'gbpp --trace' into text, one
+// op per line:
+//
+//     A:01 F:B0 B:00 C:13 D:00 E:D8 H:01 L:4D SP:FFFE PC:0100 OP:00 IME:1 CY:0
+//
+// which starts out the same as the logs other emulators (and Gameboy Doctor)
+// write, so they can be compared directly. With --diff, it compares a trace
+// against a reference - either another binary trace or a text log of lines
+// like the one above - and shows where they first differ. Only the fields
+// both sides have are compared, and if both have cycle counts, whichever
+// starts earlier is skipped ahead to line them up.
+
+enum Field { A, F, B, C, D, E, H, L, SP, PC, OP, IME, CY, FIELD_COUNT };
+
+const char *FIELD_NAMES[FIELD_COUNT] = {
+    "A", "F", "B", "C", "D", "E", "H", "L", "SP", "PC", "OP", "IME", "CY"
+};
+
+// a single op's worth of fields, only some of which may be known
+struct Record {
+    u64 values[FIELD_COUNT];
+    u32 present = 0;
+
+    void set(int field, u64 value) {
+        values[field] = value;
+        present |= 1 << field;
+    }
+};
+
+void printUsage() {
+    std::cerr << "Usage: ./gbpp-trace <TRACE>\n"
+              << "       ./gbpp-trace --diff <TRACE> <REFERENCE> "
+              << "[-c CONTEXT]\n";
+}
+
+std::string format(const Record &record) {
+    std::string line;
+    char field[32];
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        if (!(record.present & (1 << i))) {
+            continue;
+        }
+        if (i == CY) {
+            std::snprintf(field, sizeof(field), "%s:%llu", FIELD_NAMES[i],
+                          (unsigned long long)record.values[i]);
+        } else {
+            int width = i == SP || i == PC ? 4 : i == IME ? 1 : 2;
+            std::snprintf(field, sizeof(field), "%s:%0*llX", FIELD_NAMES[i],
+                          width, (unsigned long long)record.values[i]);
+        }
+        line += line.empty() ? field : std::string(" ") + field;
+    }
+    return line;
+}
+
+Record fromEntry(const Trace::Entry &entry, u64 time) {
+    const Registers &regs = entry.regs;
+    Record record;
+    record.set(A, regs.A);
+    record.set(F, regs.F & 0xF0);
+    record.set(B, regs.B);
+    record.set(C, regs.C);
+    record.set(D, regs.D);
+    record.set(E, regs.E);
+    record.set(H, regs.H);
+    record.set(L, regs.L);
+    record.set(SP, regs.SP);
+    record.set(PC, regs.PC);
+    record.set(OP, entry.stamp & 0xFF);
+    record.set(IME, (regs.F & Trace::IME_BIT) != 0);
+    record.set(CY, time);
+    return record;
+}
+
+// parse 'KEY:VALUE' fields, ignoring any that aren't known (such as the
+// PCMEM field in Gameboy Doctor logs) - a PC given as 'bank:address' just
+// uses the address
+Record parseLine(const std::string &line) {
+    Record record;
+    std::istringstream words(line);
+    std::string word;
+    while (words >> word) {
+        size_t colon = word.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string key = word.substr(0, colon);
+        std::string value = word.substr(word.rfind(':') + 1);
+        for (int i = 0; i < FIELD_COUNT; i++) {
+            if (key == FIELD_NAMES[i]) {
+                record.set(i, strtoull(value.c_str(), nullptr,
+                                       i == CY ? 10 : 16));
+            }
+        }
+    }
+    return record;
+}
+
+// read either kind of trace
+bool load(const std::string &path, std::vector<Record> &records) {
+    std::vector<Trace::Entry> entries;
+    std::vector<u64> times;
+    if (Trace::read(path, entries, times)) {
+        records.reserve(entries.size());
+        for (size_t i = 0; i < entries.size(); i++) {
+            records.push_back(fromEntry(entries[i], times[i]));
+        }
+        return true;
+    }
+
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        Record record = parseLine(line);
+        if (record.present) {
+            records.push_back(record);
+        }
+    }
+    return true;
+}
+
+int diff(const std::vector<Record> &trace,
+         const std::vector<Record> &reference, int context) {
+    // line the two up by cycle, if they both have them
+    size_t i = 0;
+    size_t j = 0;
+    u32 both = 1 << CY;
+    if (!trace.empty() && !reference.empty() &&
+        (trace[0].present & reference[0].present & both)) {
+        while (i < trace.size() && trace[i].values[CY] <
+                                       reference[0].values[CY]) {
+            i++;
+        }
+        while (j < reference.size() && reference[j].values[CY] <
+                                           trace[0].values[CY]) {
+            j++;
+        }
+    }
+
+    size_t start = i;
+    for (; i < trace.size() && j < reference.size(); i++, j++) {
+        u32 common = trace[i].present & reference[j].present;
+        u32 differ = 0;
+        for (int field = 0; field < FIELD_COUNT; field++) {
+            if ((common & (1 << field)) &&
+                trace[i].values[field] != reference[j].values[field]) {
+                differ |= 1 << field;
+            }
+        }
+        if (!differ) {
+            continue;
+        }
+
+        std::cout << "traces differ after " << i - start << " matching ops\n";
+        size_t back = std::min<size_t>(context, std::min(i, j));
+        for (size_t k = back; k > 0; k--) {
+            std::cout << "  " << format(trace[i - k]) << "\n";
+        }
+        std::cout << "- " << format(trace[i]) << "\n"
+                  << "+ " << format(reference[j]) << "\n"
+                  << "differing:";
+        for (int field = 0; field < FIELD_COUNT; field++) {
+            if (differ & (1 << field)) {
+                std::cout << " " << FIELD_NAMES[field];
+            }
+        }
+        std::cout << "\n";
+        return 1;
+    }
+
+    std::cout << "traces match for " << i - start << " ops\n";
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    std::vector<const char *> paths;
+    bool compare = false;
+    int context = 8;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--diff")) {
+            compare = true;
+        } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            context = atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            paths.push_back(argv[i]);
+        } else {
+            printUsage();
+            return -1;
+        }
+    }
+    if (paths.size() != (compare ? 2u : 1u)) {
+        printUsage();
+        return -1;
+    }
+
+    std::vector<std::vector<Record>> traces(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (!load(paths[i], traces[i])) {
+            std::cerr << "Could not read trace: " << paths[i] << "\n";
+            return -1;
+        }
+    }
+
+    if (compare) {
+        return diff(traces[0], traces[1], context);
+    }
+
+    for (const Record &record : traces[0]) {
+        std::cout << format(record) << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include "trace.hpp"
+#include <algorithm>
+#include <fstream>
+
+void Trace::setup(size_t entries) {
+    size_t size = 1;
+    while (size < entries) {
+        size *= 2;
+    }
+    ring.assign(size, Entry());
+    mask = size - 1;
+    count = 0;
+}
+
+bool Trace::isEnabled() {
+    return !ring.empty();
+}
+
+size_t Trace::getCount() {
+    return std::min<u64>(count, ring.size());
+}
+
+bool Trace::write(const std::string &path) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    size_t held = getCount();
+    Header header = {MAGIC, VERSION, held, last};
+    file.write((const char *)&header, sizeof(header));
+
+    // the oldest entry is the next to be overwritten, if the ring is full
+    size_t first = (count - held) & mask;
+    size_t wrapped = std::min(held, ring.size() - first);
+    file.write((const char *)&ring[first], wrapped * sizeof(Entry));
+    file.write((const char *)&ring[0], (held - wrapped) * sizeof(Entry));
+    return file.good();
+}
+
+bool Trace::read(const std::string &path, std::vector<Entry> &entries,
+                 std::vector<u64> &times) {
+    std::ifstream file(path, std::ios::binary);
+    Header header;
+    if (!file.read((char *)&header, sizeof(header)) ||
+        header.magic != MAGIC || header.version != VERSION) {
+        return false;
+    }
+
+    entries.resize(header.count);
+    if (!file.read((char *)entries.data(), header.count * sizeof(Entry))) {
+        return false;
+    }
+
+    // entries only keep the low 24 bits of their cycle, so work back from
+    // the newest one - which is fine as long as no op takes 2^24 cycles
+    // (including any time spent halted before it)
+    times.resize(header.count);
+    u64 time = header.endTime;
+    for (size_t i = header.count; i-- > 0;) {
+        if (i + 1 < header.count) {
+            u32 gap = ((entries[i + 1].stamp >> 8) - (entries[i].stamp >> 8)) &
+                      0xFFFFFF;
+            time -= gap;
+        }
+        times[i] = time;
+    }
+    return true;
+}
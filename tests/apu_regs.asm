@@ -0,0 +1,111 @@
+; Writes every address from NR10 (0xFF10) to the end of wave RAM (0xFF3F) -
+; including 0xFF27 - 0xFF2F, which aren't registers at all - first with all
+; ones (powering the APU on and triggering every channel) and then with all
+; zeroes (powering it off again), then leaves it running for half a second.
+; With the power off every register reads as only the bits that can't be
+; read back, which are 1s (and the unused addresses as 0xFF), so they should
+; all match the masks below. Then it powers the APU back on and checks that
+; NR11's duty, but not its length, and none of NR13 can be read back, and
+; that NR50 reads back whole.
+;
+; The result is sent over the link cable as mooneye's tests do: the
+; Fibonacci numbers 3, 5, 8, 13, 21 and 34 to pass, or six 0x42 bytes to fail.
+;
+;     rgbasm -o apu_regs.o apu_regs.asm
+;     rgblink -o apu_regs.gb apu_regs.o
+;     rgbfix -v -p 0 apu_regs.gb
+
+SECTION "entry", ROM0[$100]
+    nop
+    jp Start
+    ds $150 - @, 0
+
+SECTION "main", ROM0[$150]
+Start:
+    ld sp, $FFFE
+    ld a, $FF
+    call WriteAll
+    xor a
+    call WriteAll
+
+    ; 65536 times round takes about 25 frames
+    ld bc, 0
+.wait
+    dec bc
+    ld a, b
+    or c
+    jr nz, .wait
+
+    ld hl, $FF10
+    ld de, Masks
+.check
+    ld a, [de]
+    inc de
+    cp [hl]
+    jr nz, .fail
+    inc l
+    ld a, l
+    cp $30
+    jr nz, .check
+
+    ld a, $80
+    ldh [$FF26], a
+    ld a, $45
+    ldh [$FF11], a
+    ldh a, [$FF11]
+    cp $7F
+    jr nz, .fail
+    ld a, $12
+    ldh [$FF13], a
+    ldh a, [$FF13]
+    cp $FF
+    jr nz, .fail
+    ld a, $35
+    ldh [$FF24], a
+    ldh a, [$FF24]
+    cp $35
+    jr nz, .fail
+    ld hl, Passed
+    jr .send
+.fail
+    ld hl, Failed
+
+.send
+    ld b, 6
+.next
+    ld a, [hl+]
+    ldh [$FF01], a
+    ld a, $81
+    ldh [$FF02], a
+.busy
+    ldh a, [$FF02]
+    bit 7, a
+    jr nz, .busy
+    dec b
+    jr nz, .next
+.done
+    jr .done
+
+; write A to 0xFF10 - 0xFF3F
+WriteAll:
+    ld hl, $FF10
+.loop
+    ld [hl+], a
+    bit 6, l
+    jr z, .loop
+    ret
+
+; what NR10 - NR52 and the unused addresses up to wave RAM read as with
+; the power off
+Masks:
+    db $80, $3F, $00, $FF, $BF
+    db $FF, $3F, $00, $FF, $BF
+    db $7F, $FF, $9F, $FF, $BF
+    db $FF, $FF, $00, $00, $BF
+    db $00, $00, $70
+    db $FF, $FF, $FF, $FF, $FF, $FF, $FF, $FF, $FF
+
+Passed:
+    db 3, 5, 8, 13, 21, 34
+Failed:
+    db $42, $42, $42, $42, $42, $42
@@ -0,0 +1,412 @@
+; Checks the result and flags of the ops that have had bugs fixed in them:
+; RL, RR and the other rotates through carry, DAA after adds and subtracts,
+; ADC and SBC with the carry in, ADD SP,e and LD HL,SP+e (whose flags come
+; from the low byte), and a few INC, DEC, ADD HL, SWAP, CP and BIT flags.
+;
+; Each case records its number at 0xFF80, then pushes AF and calls CheckAF
+; with the expected A in D and F in E. The result is printed over the link
+; cable as blargg's tests do: "Passed", or "Failed" and the number of the
+; case that went wrong in hex.
+;
+;     rgbasm -o cpu_ops.o cpu_ops.asm
+;     rgblink -o cpu_ops.gb cpu_ops.o
+;     rgbfix -v -p 0 cpu_ops.gb
+
+SECTION "entry", ROM0[$100]
+    nop
+    jp Start
+    ds $150 - @, 0
+
+SECTION "main", ROM0[$150]
+Start:
+    ld sp, $FFFE
+    ld hl, Title
+    call Print
+
+    ; RL B rotates B, leaving A alone
+    ld a, 1
+    ldh [$FF80], a
+    ld a, $33
+    ld b, $85
+    scf
+    ccf
+    rl b
+    push af
+    ld a, b
+    push af
+    ld de, $0A10
+    call CheckAF
+    ld de, $3310
+    call CheckAF
+
+    ; RL C shifts the carry in
+    ld a, 2
+    ldh [$FF80], a
+    ld c, $00
+    scf
+    rl c
+    ld a, c
+    push af
+    ld de, $0100
+    call CheckAF
+
+    ; RR C sets Z and carry
+    ld a, 3
+    ldh [$FF80], a
+    ld c, $01
+    scf
+    ccf
+    rr c
+    ld a, c
+    push af
+    ld de, $0090
+    call CheckAF
+
+    ; RR D shifts the carry into bit 7
+    ld a, 4
+    ldh [$FF80], a
+    ld d, $02
+    scf
+    rr d
+    ld a, d
+    push af
+    ld de, $8100
+    call CheckAF
+
+    ; RRC E
+    ld a, 5
+    ldh [$FF80], a
+    ld e, $01
+    rrc e
+    ld a, e
+    push af
+    ld de, $8010
+    call CheckAF
+
+    ; RLC H
+    ld a, 6
+    ldh [$FF80], a
+    ld h, $80
+    rlc h
+    ld a, h
+    push af
+    ld de, $0110
+    call CheckAF
+
+    ; RLA never sets Z
+    ld a, 7
+    ldh [$FF80], a
+    ld a, $80
+    scf
+    ccf
+    rla
+    push af
+    ld de, $0010
+    call CheckAF
+
+    ; RL [HL]
+    ld a, 8
+    ldh [$FF80], a
+    ld hl, $C000
+    ld [hl], $80
+    scf
+    ccf
+    rl [hl]
+    ld a, [hl]
+    push af
+    ld de, $0090
+    call CheckAF
+
+    ; DAA after an add
+    ld a, 9
+    ldh [$FF80], a
+    ld a, $45
+    add $38
+    daa
+    push af
+    ld de, $8300
+    call CheckAF
+
+    ; DAA after a subtract with a half borrow
+    ld a, 10
+    ldh [$FF80], a
+    ld a, $83
+    sub $38
+    daa
+    push af
+    ld de, $4540
+    call CheckAF
+
+    ; DAA carrying out of the high digit
+    ld a, 11
+    ldh [$FF80], a
+    ld a, $99
+    add $01
+    daa
+    push af
+    ld de, $0090
+    call CheckAF
+
+    ; DAA after 10 - 1
+    ld a, 12
+    ldh [$FF80], a
+    ld a, $10
+    sub $01
+    daa
+    push af
+    ld de, $0940
+    call CheckAF
+
+    ; DAA after 0 - 1 keeps the borrow
+    ld a, 13
+    ldh [$FF80], a
+    xor a
+    sub $01
+    daa
+    push af
+    ld de, $9950
+    call CheckAF
+
+    ; ADC with the carry in overflowing to zero
+    ld a, 14
+    ldh [$FF80], a
+    xor a
+    scf
+    adc $FF
+    push af
+    ld de, $00B0
+    call CheckAF
+
+    ; ADC with only the carry making a half carry
+    ld a, 15
+    ldh [$FF80], a
+    ld a, $0F
+    scf
+    adc $00
+    push af
+    ld de, $1020
+    call CheckAF
+
+    ; SBC with the carry in borrowing to zero
+    ld a, 16
+    ldh [$FF80], a
+    xor a
+    scf
+    sbc $FF
+    push af
+    ld de, $00F0
+    call CheckAF
+
+    ; SBC with only the carry making a half borrow
+    ld a, 17
+    ldh [$FF80], a
+    ld a, $10
+    scf
+    sbc $00
+    push af
+    ld de, $0F60
+    call CheckAF
+
+    ; ADD SP,-8 from $FFF8 carries out of both nibble and byte
+    ld a, 18
+    ldh [$FF80], a
+    ld sp, $FFF8
+    add sp, -8
+    ld [$C100], sp
+    ld sp, $FFFE
+    ld a, [$C100]
+    push af
+    ld de, $F030
+    call CheckAF
+    ld a, [$C101]
+    cp $FF
+    jp nz, Fail
+
+    ; ADD SP,-1
+    ld a, 19
+    ldh [$FF80], a
+    ld sp, $D005
+    add sp, -1
+    ld [$C100], sp
+    ld sp, $FFFE
+    ld a, [$C100]
+    push af
+    ld de, $0430
+    call CheckAF
+    ld a, [$C101]
+    cp $D0
+    jp nz, Fail
+
+    ; LD HL,SP+1 carrying into the high byte
+    ld a, 20
+    ldh [$FF80], a
+    ld sp, $D0FF
+    ld hl, sp+1
+    ld sp, $FFFE
+    ld a, l
+    ld [$C100], a
+    ld a, h
+    ld [$C101], a
+    ld a, [$C100]
+    push af
+    ld de, $0030
+    call CheckAF
+    ld a, [$C101]
+    cp $D1
+    jp nz, Fail
+
+    ; LD HL,SP-1 borrowing from the high byte, with no carries
+    ld a, 21
+    ldh [$FF80], a
+    ld sp, $D000
+    ld hl, sp-1
+    ld sp, $FFFE
+    ld a, l
+    ld [$C100], a
+    ld a, h
+    ld [$C101], a
+    ld a, [$C100]
+    push af
+    ld de, $FF00
+    call CheckAF
+    ld a, [$C101]
+    cp $CF
+    jp nz, Fail
+
+    ; INC B keeps the carry
+    ld a, 22
+    ldh [$FF80], a
+    ld b, $FF
+    scf
+    inc b
+    ld a, b
+    push af
+    ld de, $00B0
+    call CheckAF
+
+    ; DEC B with a half borrow
+    ld a, 23
+    ldh [$FF80], a
+    ld b, $10
+    scf
+    ccf
+    dec b
+    ld a, b
+    push af
+    ld de, $0F60
+    call CheckAF
+
+    ; ADD HL,BC carries from bits 11 and 15, leaving Z alone
+    ld a, 24
+    ldh [$FF80], a
+    ld hl, $8FFF
+    ld bc, $7001
+    xor a
+    add hl, bc
+    ld a, l
+    ld [$C100], a
+    ld a, h
+    push af
+    ld de, $00B0
+    call CheckAF
+    ld a, [$C100]
+    and a
+    jp nz, Fail
+
+    ; SWAP A
+    ld a, 25
+    ldh [$FF80], a
+    ld a, $F0
+    swap a
+    push af
+    ld de, $0F00
+    call CheckAF
+
+    ; CP with a borrow
+    ld a, 26
+    ldh [$FF80], a
+    ld a, $10
+    cp $20
+    push af
+    ld de, $1050
+    call CheckAF
+
+    ; BIT keeps the carry
+    ld a, 27
+    ldh [$FF80], a
+    ld h, $7F
+    scf
+    bit 7, h
+    ld a, h
+    push af
+    ld de, $7FB0
+    call CheckAF
+
+    ld hl, Passed
+    call Print
+.done
+    jr .done
+
+; fail unless the AF pushed before the call is DE (trashing BC and HL)
+CheckAF:
+    pop hl
+    pop bc
+    push hl
+    ld a, b
+    cp d
+    jr nz, Fail
+    ld a, c
+    cp e
+    jr nz, Fail
+    ret
+
+Fail:
+    ld sp, $FFFE
+    ld hl, Failed
+    call Print
+    ldh a, [$FF80]
+    call PrintHex
+    ld a, 10
+    call PrintChar
+.done
+    jr .done
+
+; send the string at HL up to its terminating zero
+Print:
+    ld a, [hl+]
+    and a
+    ret z
+    call PrintChar
+    jr Print
+
+; send A as two hex digits
+PrintHex:
+    push af
+    swap a
+    call .digit
+    pop af
+.digit
+    and $0F
+    cp 10
+    jr c, .decimal
+    add 7
+.decimal
+    add $30
+
+; send A over the link cable
+PrintChar:
+    ldh [$FF01], a
+    ld a, $81
+    ldh [$FF02], a
+.busy
+    ldh a, [$FF02]
+    bit 7, a
+    jr nz, .busy
+    ret
+
+Title:
+    db "cpu_ops\n\n", 0
+Passed:
+    db "Passed\n", 0
+Failed:
+    db "Failed check ", 0